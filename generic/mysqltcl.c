@@ -46,39 +46,171 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+
+#if defined(__AVX2__)
+   #include <immintrin.h>
+#elif defined(__SSE2__)
+   #include <emmintrin.h>
+#endif
 
 #define MYSQL_SMALL_SIZE  TCL_RESULT_SIZE /* Smaller buffer size. */
 #define MYSQL_NAME_LEN     80    /* Max. database name length. */
-/* #define PREPARED_STATEMENT */
+#if (MYSQL_VERSION_ID >= 40107) && !defined(PREPARED_STATEMENT)
+#define PREPARED_STATEMENT
+#endif
+#if (MYSQL_VERSION_ID >= 80001) && !defined(MARIADB_BASE_VERSION)
+typedef bool my_bool;
+#endif
+/* array binding of MariaDB Connector/C (STMT_ATTR_ARRAY_SIZE) */
+#if defined(PREPARED_STATEMENT) && defined(MARIADB_PACKAGE_VERSION_ID) && (MARIADB_PACKAGE_VERSION_ID >= 30000)
+#define BULK_EXECUTE
+#endif
 
 enum MysqlHandleType {HT_CONNECTION=1,HT_QUERY=2,HT_STATEMENT=3};
 
+/* counters of connection (mysql::stats); times in microseconds */
+typedef struct MysqlStats {
+  Tcl_WideInt queries;           /* statements sent or prepared statements executed */
+  Tcl_WideInt rows;              /* rows fetched */
+  Tcl_WideInt bytesSent;         /* bytes of statements sent */
+  Tcl_WideInt bytesReceived;     /* bytes of fetched cells */
+  Tcl_WideInt encoded;           /* bytes converted to connection encoding */
+  Tcl_WideInt decoded;           /* bytes converted from connection encoding */
+  Tcl_WideInt serverTime;        /* time of sending statements and storing results (-timing) */
+  Tcl_WideInt convertTime;       /* time of converting rows to Tcl objects (-timing) */
+  Tcl_WideInt errors;            /* server conflicts */
+  Tcl_WideInt reconnects;        /* changes of server connection id */
+  unsigned long threadId;        /* server connection id seen last; no counter */
+} MysqlStats;
+
 typedef struct MysqlTclHandle {
   MYSQL * connection;         /* Connection handle, if connected; NULL otherwise. */
   char database[MYSQL_NAME_LEN];  /* Db name, if selected; NULL otherwise. */
   MYSQL_RES* result;              /* Stored result, if any; NULL otherwise. */
   int res_count;                 /* Count of unfetched rows in result. */
   int col_count;                 /* Column count in result, if any. */
-  int number;                    /* handle id */
+  Tcl_WideInt number;            /* handle id: slot and generation (see MYSQL_SLOT_BITS) */
   enum MysqlHandleType type;                      /* handle type */
   Tcl_Encoding encoding;         /* encoding for connection */
+  Tcl_Obj **colNames;            /* column names of result shared as dict keys; NULL until needed */
+  int colNamesCount;             /* number of objects in colNames */
+  char *colPlan;                 /* conversion of every result column (enum ColumnConversion); NULL until needed */
+  int typed;                     /* convert numeric columns to numeric Tcl objects (connection default) */
+  int resultTyped;               /* numeric conversion for the current result */
+  Tcl_Obj **rowObjv;             /* scratch array for building rows as lists (col_count entries) */
+  char *convBuf;                 /* reusable buffer for encoding conversion of cells */
+  int convBufSize;               /* allocated size of convBuf */
+  char *queryBuf;                /* reusable buffer for encoding of statements */
+  int queryBufSize;              /* allocated size of queryBuf */
+  Tcl_WideInt encodedBytes;      /* count of statement bytes converted to connection encoding */
+  struct MysqlAsync *async;      /* pending asynchronous query of connection (mysql::query -async); NULL otherwise */
+  struct MysqlPool *pool;        /* pool of connection (mysql::pool checkout); NULL otherwise */
+  unsigned long maxAllowedPacket; /* max_allowed_packet of server; 0 until needed (mysql::insert) */
+  int multiStatements;           /* multiple statements are enabled (-multistatement, mysql::setserveroption) */
+  struct MysqlTclHandle *parent; /* connection handle of query or statement handle; NULL otherwise */
+  struct MysqlTclHandle *firstChild; /* query and statement handles of connection handle */
+  struct MysqlTclHandle *prevSibling; /* list of children of parent */
+  struct MysqlTclHandle *nextSibling;
+  struct MysqltclState *statePtr; /* state of interpreter owning the handle */
+  MysqlStats stats;              /* counters; query and statement handles count for their connection */
+  Tcl_WideInt traceSeq;          /* trace entry of last statement; 0 if none */
+  Tcl_WideInt stmtClock;         /* start of last statement for trace and histogram */
+  struct MysqlHistogram *histogram; /* histogram of last statement; NULL if none */
+  unsigned int histGeneration;   /* histGeneration of state for histogram */
+  Tcl_WideInt histValue;         /* duration recorded for last statement; -1 if none */
 #ifdef PREPARED_STATEMENT
-  MYSQL_STMT *statement;         /* used only by prepared statements*/
-  MYSQL_BIND *bindParam;
-  MYSQL_BIND *bindResult;
-  MYSQL_RES *resultMetadata;
-  MYSQL_RES *paramMetadata;
+  struct MysqlStatement *stmt;   /* used only by prepared statements*/
+  struct MysqlStmtCache *stmtCache; /* cache of prepared statements of connection (-stmtcache); NULL otherwise */
 #endif
 } MysqlTclHandle;
 
+/*
+ * Handles of interpreter are kept in an array of slots. The handle number
+ * (and name) is the slot index in the low MYSQL_SLOT_BITS bits and the
+ * generation of the slot above. Closing a handle increments the generation,
+ * so names of closed handles never find a newer handle in the same slot.
+ */
+#define MYSQL_SLOT_BITS 20
+#define MYSQL_SLOT_MASK ((1<<MYSQL_SLOT_BITS)-1)
+
+typedef struct MysqlHandleSlot {
+  MysqlTclHandle *handle;        /* NULL if slot is free */
+  unsigned int generation;       /* generation of current or next handle */
+  int nextFree;                  /* next free slot if slot is free; -1 at end */
+} MysqlHandleSlot;
+
+/*
+ * Statement trace (mysql::trace): the last statements are kept in a ring
+ * buffer of fixed size. Entry of statement seq is entries[(seq-1)%size].
+ */
+#define MYSQL_TRACE_SQL_LEN 256   /* bytes of statement text kept per entry */
+#define MYSQL_TRACE_SIZE 1000     /* default count of entries */
+
+typedef struct MysqlTraceEntry {
+  Tcl_WideInt seq;               /* number of statement; 0 if entry is empty */
+  Tcl_WideInt handle;            /* number of handle */
+  enum MysqlHandleType type;     /* type of handle */
+  Tcl_WideInt time;              /* start, microseconds since epoch */
+  Tcl_WideInt duration;          /* microseconds until statement is sent or result stored */
+  Tcl_WideInt rows;              /* affected or stored rows; -1 if unknown */
+  int error;                     /* server error code; 0 if none */
+  int reported;                  /* entry is queued for callback */
+  char sql[MYSQL_TRACE_SQL_LEN]; /* statement text (utf-8), truncated */
+} MysqlTraceEntry;
+
+typedef struct MysqlTrace {
+  MysqlTraceEntry *entries;
+  int size;
+  Tcl_WideInt first;             /* oldest statement for dump (see dump -clear) */
+  Tcl_WideInt threshold;         /* callback for statements taking as long (microseconds) */
+  Tcl_Obj *command;              /* callback prefix; NULL if none */
+  Tcl_Obj *pending;              /* seq of entries waiting for callback */
+  int inCallback;                /* statements of callback are not reported */
+} MysqlTrace;
+
+/*
+ * Latency histogram of statements with the same fingerprint (mysql::histogram).
+ * Values below 16 microseconds have own buckets, above every power of two
+ * is split into 8 buckets, so a bucket is at most 12.5% wide.
+ */
+#define MYSQL_FINGERPRINT_LEN 512 /* max bytes of fingerprint */
+#define MYSQL_HIST_BUCKETS 320    /* up to 2^41 microseconds */
+
+typedef struct MysqlHistogram {
+  Tcl_WideInt count;
+  Tcl_WideInt sum;               /* microseconds */
+  Tcl_WideInt buckets[MYSQL_HIST_BUCKETS];
+} MysqlHistogram;
+
 typedef struct MysqltclState { 
-  Tcl_HashTable hash;
-  int handleNum;
+  MysqlHandleSlot *slots;        /* all open handles by slot index */
+  int slotCount;                 /* allocated slots */
+  int slotsUsed;                 /* slots used so far; all handles are below */
+  int freeSlot;                  /* first free slot below slotsUsed; -1 if none */
   char *MysqlNullvalue;
-  // Tcl_Obj *nullObjPtr;
+  Tcl_HashTable pools;          /* connection pools by name (mysql::pool) */
+  int statusLazy;               /* mysqlstatus(code) is written on errors and reads only (mysql::config -status lazy) */
+  int statusCode;               /* current status code in lazy status mode */
+  int statsTiming;              /* measure times of mysql::stats (mysql::config -timing) */
+  MysqlStats closedStats;       /* counters of closed handles */
+  MysqlTrace *trace;            /* statement trace; NULL if off */
+  Tcl_WideInt traceCount;       /* statements traced so far, never reset */
+  Tcl_AsyncHandler traceAsync;  /* calls trace callback at next safe point; NULL until needed */
+  int histogramOn;              /* record histograms (mysql::config -histogram) */
+  Tcl_HashTable histograms;     /* MysqlHistogram by fingerprint */
+  unsigned int histGeneration;  /* incremented if histograms are deleted */
+  Tcl_Interp *interp;
 } MysqltclState;
 
 static char *MysqlHandlePrefix = "mysql";
+/* interpreter data key of MysqltclState */
+#define MYSQL_ASSOC_KEY "mysqltcl"
+static const Tcl_ObjType *byteArrayType;
+static const Tcl_ObjType *intType;
+static const Tcl_ObjType *wideIntType;
+static const Tcl_ObjType *doubleType;
 /* Prefix string used to identify handles.
  * The following must be strlen(MysqlHandlePrefix).
  */
@@ -93,10 +225,160 @@ static char *MysqlHandlePrefix = "mysql";
 #define MYSQL_STATUS_NULLV  "nullvalue"
 
 #define FUNCTION_NOT_AVAILABLE "function not available"
+#define MYSQL_TOO_MANY_HANDLES "too many handles"
 
 /* C variable corresponding to mysqlstatus(nullvalue) */
 #define MYSQL_NULLV_INIT ""
 
+/* Conversion of result columns to Tcl objects (see getColumnPlan) */
+enum ColumnConversion {
+  CONV_TEXT,     /* text in connection encoding: Tcl_ExternalToUtf */
+  CONV_UTF8,     /* text on utf-8 connection: taken as is if valid for Tcl */
+  CONV_ASCII,    /* numbers and dates: always plain ASCII, no conversion */
+  CONV_BINARY,   /* binary data or binary connection: byte array */
+  CONV_WIDEINT,  /* -typed integer columns */
+  CONV_DOUBLE    /* -typed floating columns */
+};
+
+/* conversion buffers larger than this are released with the result */
+#define MYSQL_CONVBUF_KEEP 65536
+
+/* query buffers larger than this are released after the statement */
+#define MYSQL_QUERYBUF_KEEP (4*1024*1024)
+
+/* charsetnr of binary strings (BLOB, BINARY, VARBINARY) */
+#define MYSQL_BINARY_CHARSETNR 63
+
+#ifdef PREPARED_STATEMENT
+/* text columns of prepared statements are fetched into buffers of at most
+ * this size; longer values are fetched again by mysql_stmt_fetch_column */
+#define MYSQL_STMT_COLBUF_MAX 8192
+
+/* Numeric value of prepared statement parameter or result column */
+typedef union MysqlStmtNum {
+  Tcl_WideInt wide;
+  double dbl;
+} MysqlStmtNum;
+
+/* Bound value of prepared statement parameter or result column */
+typedef struct MysqlStmtValue {
+  MysqlStmtNum num;              /* integer and double values */
+  unsigned long length;          /* length of data */
+  my_bool isNull;
+  my_bool error;                 /* result column was truncated */
+  char conversion;               /* conversion of result column (enum ColumnConversion) */
+} MysqlStmtValue;
+
+/* Prepared statement with its bindings, owned by statement handle or cache */
+typedef struct MysqlStatement {
+  MYSQL_STMT *statement;
+  MYSQL_BIND *bindParam;         /* parameters, filled for every execution */
+  MYSQL_BIND *bindResult;        /* result columns, allocated once from metadata */
+  MysqlStmtValue *paramValues;   /* numeric values and lengths of parameters */
+  MysqlStmtValue *resultValues;  /* values, lengths and flags of result columns */
+  Tcl_DString *paramStrings;     /* parameters converted into connection encoding */
+  char *resultBuf;               /* buffers of text result columns */
+  Tcl_Obj **rowObjv;             /* scratch array for building rows (colCount entries) */
+  int paramCount;                /* number of ? in statement */
+  int colCount;                  /* number of result columns */
+  MYSQL_RES *resultMetadata;
+  char *sql;                     /* statement text, key in cache and text for trace */
+  int generation;                /* generation of cache at prepare */
+  struct MysqlStatement *prev;   /* LRU list of cache */
+  struct MysqlStatement *next;
+} MysqlStatement;
+
+/*
+ * Idle prepared statements of one connection by SQL text (-stmtcache).
+ * mysql::prepare takes statements from cache, mysql::close of statement
+ * handle puts them back; least recently used statements are closed.
+ */
+typedef struct MysqlStmtCache {
+  Tcl_HashTable table;           /* idle statements by SQL text */
+  MysqlStatement *first;         /* least recently used */
+  MysqlStatement *last;          /* most recently used */
+  int size;                      /* maximal count of idle statements */
+  int count;
+  int generation;                /* incremented by invalidation; older statements are not cached */
+  unsigned long threadId;        /* server connection id; it changes on reconnect */
+  Tcl_WideInt hits;
+  Tcl_WideInt misses;
+} MysqlStmtCache;
+#endif
+
+/* Pending asynchronous query, the result is read if the socket
+ * of connection becomes readable. It is kept by the connection handle,
+ * so its query and statement handles are blocked too. */
+typedef struct MysqlAsync {
+  Tcl_Interp *interp;
+  MysqltclState *statePtr;
+  MysqlTclHandle *owner;         /* connection handle that keeps the pending query */
+  MysqlTclHandle *handle;        /* handle that sent the query (owner or its child) */
+  Tcl_Obj *callback;             /* command prefix called with status and result */
+  Tcl_Obj *command;              /* words of mysql::query command for error message */
+  int typed;                     /* -typed for result */
+  int fd;                        /* socket of connection */
+} MysqlAsync;
+
+/* Options of mysql::connect (see parseConnectOptions) */
+typedef struct MysqlConnectParams {
+  char *hostname;
+  char *user;
+  char *password;
+  char *db;
+  char *socket;
+  char *encodingname;
+  char *sslkey;
+  char *sslcert;
+  char *sslca;
+  char *sslcapath;
+  char *sslcipher;
+  int port;
+  int flags;                     /* CLIENT_ flags for mysql_real_connect */
+  int isSSL;
+  int typed;
+  int stmtCacheSize;             /* size of prepared statement cache, 0 disabled */
+} MysqlConnectParams;
+
+/* Connection pool (mysql::pool) */
+typedef struct MysqlPool {
+  char *name;
+  MysqlConnectParams params;     /* options for new connections */
+  int min;                       /* connections kept open */
+  int max;                       /* maximal count of open connections */
+  int idleTimeout;               /* seconds after idle connections are closed; 0 never */
+  MYSQL **idle;                  /* idle connections, last checked in at end (max entries) */
+  long *idleSince;               /* checkin time of idle connections */
+  int idleCount;
+  int active;                    /* checked out connections */
+  int closed;                    /* pool is closed, wait for checkin of active connections */
+  int shared;                    /* process wide pool (-shared), usable from all threads */
+  char charset[MYSQL_NAME_LEN];  /* character set of new connections, set again on checkin; empty until known */
+  Tcl_Mutex mutex;               /* protects idle list and counters */
+} MysqlPool;
+
+/*
+ * Process wide data: shared pools by name and initialization of client library.
+ * The mutex protects sharedPools; lock it before the mutex of a pool.
+ */
+TCL_DECLARE_MUTEX(mysqltclMutex)
+static Tcl_HashTable sharedPools;
+static int mysqltclInitialized = 0;
+
+/* Per thread data: mysql_thread_init was called for this thread */
+typedef struct ThreadSpecificData {
+  int threadInitialized;
+} ThreadSpecificData;
+static Tcl_ThreadDataKey dataKey;
+
+/* Variables of binding list of mysql::map and mysql::receive.
+ * Columns bound to "-" are left out. */
+typedef struct MysqlVarBinding {
+  int count;                     /* number of bound variables */
+  int *column;                   /* result column of every variable */
+  Tcl_Obj **varNames;            /* variable names (own references) */
+} MysqlVarBinding;
+
 /* Check Level for mysql_prologue */
 enum CONNLEVEL {CL_PLAIN,CL_CONN,CL_DB,CL_RES};
 
@@ -118,17 +400,23 @@ static int Mysqltcl_InsertId(ClientData clientData, Tcl_Interp *interp, int objc
 static int Mysqltcl_Query(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
 static int Mysqltcl_Receive(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
 static int MysqlHandleSet _ANSI_ARGS_((Tcl_Interp *interp,Tcl_Obj *objPtr));
-static void MysqlHandleFree _ANSI_ARGS_((Tcl_Obj *objPtr));
 static int MysqlNullSet _ANSI_ARGS_((Tcl_Interp *interp,Tcl_Obj *objPtr));
 static Tcl_Obj *Mysqltcl_NewNullObj(MysqltclState *mysqltclState);
 static void UpdateStringOfNull _ANSI_ARGS_((Tcl_Obj *objPtr));
+static char *Mysqltcl_StatusTrace(ClientData clientData, Tcl_Interp *interp, CONST char *name1, CONST char *name2, int flags);
+static void setStatusMode(MysqltclState *statePtr,int lazy);
+static void addStats(MysqlStats *sum,MysqlStats *stats);
+static void freeTrace(MysqlTrace *trace);
+static void deleteHistograms(MysqltclState *statePtr,Tcl_HashEntry *entryPtr);
 
 /* handle object type 
- * This section defince funtions for Handling new Tcl_Obj type */
+ * This section defince funtions for Handling new Tcl_Obj type
+ * The internal representation is the handle number (internalRep.wideValue);
+ * the handle is looked up in the slots of interpreter for every use. */
   
 Tcl_ObjType mysqlHandleType = {
     "mysqlhandle", 
-    MysqlHandleFree,
+    (Tcl_FreeInternalRepProc *) NULL,
     (Tcl_DupInternalRepProc *) NULL,
     NULL,
     MysqlHandleSet
@@ -141,45 +429,467 @@ Tcl_ObjType mysqlNullType = {
     MysqlNullSet
 };
 
+/* returned for handle objects of closed handles; connection is NULL */
+static MysqlTclHandle closedHandle;
 
 static MysqltclState *getMysqltclState(Tcl_Interp *interp) {
-  Tcl_CmdInfo cmdInfo;
-  if (Tcl_GetCommandInfo(interp,"mysqlconnect",&cmdInfo)==0) {
-    return NULL;
+  if (interp == NULL) return NULL;
+  return (MysqltclState *)Tcl_GetAssocData(interp, MYSQL_ASSOC_KEY, NULL);
+}
+
+static int isUtf8Handle(MysqlTclHandle *handle);
+
+/*
+ * Counters of mysql::stats. Query and statement handles count for their
+ * connection. Times are measured only with mysql::config -timing 1.
+ */
+static MysqlStats *handleStats(MysqlTclHandle *handle)
+{
+  return (handle->parent != NULL) ? &handle->parent->stats : &handle->stats;
+}
+
+/* connection handle of query or statement handle, that owns the MYSQL connection */
+static MysqlTclHandle *ownerHandle(MysqlTclHandle *handle)
+{
+  return (handle->parent != NULL) ? handle->parent : handle;
+}
+
+/* monotonic clock in microseconds */
+static Tcl_WideInt monotonicMicros(void)
+{
+#ifdef _WINDOWS
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (Tcl_WideInt)(count.QuadPart/freq.QuadPart)*1000000 +
+    (Tcl_WideInt)(count.QuadPart%freq.QuadPart)*1000000/freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (Tcl_WideInt)now.tv_sec*1000000 + now.tv_nsec/1000;
+#else
+  Tcl_Time now;
+  Tcl_GetTime(&now);
+  return (Tcl_WideInt)now.sec*1000000 + now.usec;
+#endif
+}
+
+/* start of timed section; 0 if timing is off */
+static Tcl_WideInt statsStart(MysqlTclHandle *handle)
+{
+  if (handle->statePtr == NULL || !handle->statePtr->statsTiming) return 0;
+  return monotonicMicros();
+}
+
+static void statsServerTime(MysqlTclHandle *handle,Tcl_WideInt start)
+{
+  if (start != 0) handleStats(handle)->serverTime += monotonicMicros()-start;
+}
+
+static void statsConvertTime(MysqlTclHandle *handle,Tcl_WideInt start)
+{
+  if (start != 0) handleStats(handle)->convertTime += monotonicMicros()-start;
+}
+
+/* count statement sent and reconnects seen by new server connection id */
+static void statsQuery(MysqlTclHandle *handle,int length)
+{
+  MysqlStats *stats = handleStats(handle);
+  unsigned long threadId = mysql_thread_id(handle->connection);
+
+  stats->queries++;
+  stats->bytesSent += length;
+  if (threadId != stats->threadId) {
+    if (stats->threadId != 0) stats->reconnects++;
+    stats->threadId = threadId;
   }
-  return (MysqltclState *)cmdInfo.objClientData;
 }
 
-static int MysqlHandleSet(Tcl_Interp *interp, register Tcl_Obj *objPtr)
+static void statsRow(MysqlTclHandle *handle,unsigned long *lengths)
 {
-    Tcl_ObjType *oldTypePtr = objPtr->typePtr;
-    char *string;
-    MysqlTclHandle *handle;
-    Tcl_HashEntry *entryPtr;
-    MysqltclState *statePtr;
+  MysqlStats *stats = handleStats(handle);
+  int i;
+
+  stats->rows++;
+  for (i = 0; i < handle->col_count; i++) {
+    stats->bytesReceived += lengths[i];
+  }
+}
+
+/*
+ * Count server conflict for the handle that ran the statement;
+ * handle is NULL for connections without handle (pools).
+ */
+static void statsError(MysqlTclHandle *handle)
+{
+  if (handle != NULL) handleStats(handle)->errors++;
+}
 
-    string = Tcl_GetStringFromObj(objPtr, NULL);  
-    statePtr = getMysqltclState(interp);
-    if (statePtr==NULL) return TCL_ERROR;
+/*
+ * Trace entry of statement seq; NULL if it is overwritten or trace is off.
+ */
+static MysqlTraceEntry *traceEntry(MysqltclState *statePtr,Tcl_WideInt seq)
+{
+  MysqlTraceEntry *entry;
+
+  if (statePtr == NULL || statePtr->trace == NULL || seq <= 0) return NULL;
+  entry = &statePtr->trace->entries[(seq-1) % statePtr->trace->size];
+  return (entry->seq == seq) ? entry : NULL;
+}
+
+/*
+ * Start trace entry for statement of handle. encoded is true if sql is
+ * in connection encoding, otherwise it is utf-8.
+ */
+static void traceBegin(MysqlTclHandle *handle,const char *sql,int length,int encoded)
+{
+  MysqltclState *statePtr = handle->statePtr;
+  MysqlTraceEntry *entry;
+  Tcl_Time now;
+  int srcRead, dstWrote, dstChars;
+
+  handle->traceSeq = ++statePtr->traceCount;
+  entry = &statePtr->trace->entries[(handle->traceSeq-1) % statePtr->trace->size];
+  entry->seq = handle->traceSeq;
+  entry->handle = handle->number;
+  entry->type = handle->type;
+  entry->duration = 0;
+  entry->rows = -1;
+  entry->error = 0;
+  entry->reported = 0;
+  if (sql == NULL) length = 0;
+  if (encoded && handle->encoding != NULL && !isUtf8Handle(handle)) {
+    Tcl_ExternalToUtf(NULL, handle->encoding, sql, length, TCL_ENCODING_START|TCL_ENCODING_END, NULL,
+		      entry->sql, MYSQL_TRACE_SQL_LEN, &srcRead, &dstWrote, &dstChars);
+  } else {
+    /* cut before a partial utf-8 character */
+    dstWrote = (length < MYSQL_TRACE_SQL_LEN) ? length : MYSQL_TRACE_SQL_LEN-1;
+    while (dstWrote < length && dstWrote > 0 && (sql[dstWrote] & 0xC0) == 0x80) dstWrote--;
+    memcpy(entry->sql, sql, dstWrote);
+  }
+  entry->sql[dstWrote] = '\0';
+  Tcl_GetTime(&now);
+  entry->time = (Tcl_WideInt)now.sec*1000000 + now.usec;
+}
+
+/*
+ * Finish trace entry of last statement of handle; rows is set if it is
+ * not negative. Can be called again if the result is stored later.
+ * Statements over threshold are queued for the callback, that is called
+ * by the async handler after the current command.
+ */
+static void traceEnd(MysqlTclHandle *handle,MysqlTraceEntry *entry,Tcl_WideInt duration,Tcl_WideInt rows,int error)
+{
+  MysqlTrace *trace = handle->statePtr->trace;
+
+  entry->duration = duration;
+  if (rows >= 0) entry->rows = rows;
+  if (error != 0) entry->error = error;
+  if (trace->command != NULL && !trace->inCallback && !entry->reported &&
+      entry->duration >= trace->threshold) {
+    entry->reported = 1;
+    Tcl_ListObjAppendElement(NULL, trace->pending, Tcl_NewWideIntObj(entry->seq));
+    Tcl_AsyncMark(handle->statePtr->traceAsync);
+  }
+}
 
-    entryPtr = Tcl_FindHashEntry(&statePtr->hash,string);
-    if (entryPtr == NULL) {
+static int isIdentChar(char c)
+{
+  return isalnum((unsigned char)c) || c == '_' || c == '$' || (unsigned char)c >= 0x80;
+}
 
-      handle=0;
+/*
+ * Normalize statement to its fingerprint in one pass: string and number
+ * literals are replaced by ?, comments are removed and whitespace is
+ * collapsed to one space. The fingerprint is cut after
+ * MYSQL_FINGERPRINT_LEN bytes. Returns the length of fingerprint in fp.
+ */
+static int sqlFingerprint(const char *sql,int length,char *fp)
+{
+  const char *p = sql, *end = sql+length;
+  int n = 0, space = 0;
+  char c;
+
+  /* one step writes at most 2 bytes */
+  while (p < end && n < MYSQL_FINGERPRINT_LEN-2) {
+    c = *p;
+    if (isspace((unsigned char)c)) {
+      space = 1;
+      p++;
+      continue;
+    }
+    if (c == '#' || (c == '-' && p+1 < end && p[1] == '-' && (p+2 == end || isspace((unsigned char)p[2])))) {
+      while (p < end && *p != '\n') p++;
+      space = 1;
+      continue;
+    }
+    if (c == '/' && p+1 < end && p[1] == '*') {
+      for (p += 2; p+1 < end && !(p[0] == '*' && p[1] == '/'); p++);
+      p = (p+1 < end) ? p+2 : end;
+      space = 1;
+      continue;
+    }
+    if (space && n > 0) fp[n++] = ' ';
+    space = 0;
+    if (c == '\'' || c == '"') {
+      for (p++; p < end; p++) {
+	if (*p == '\\' && p+1 < end) {
+	  p++;
+	} else if (*p == c) {
+	  if (p+1 < end && p[1] == c) {
+	    p++;
+	  } else {
+	    p++;
+	    break;
+	  }
+	}
+      }
+      fp[n++] = '?';
+    } else if (c == '`') {
+      /* quoted identifier is kept */
+      fp[n++] = *p++;
+      while (p < end && n < MYSQL_FINGERPRINT_LEN-2) {
+	fp[n++] = *p;
+	if (*p++ == '`') {
+	  if (p < end && *p == '`') {
+	    fp[n++] = *p++;
+	  } else {
+	    break;
+	  }
+	}
+      }
+    } else if ((isdigit((unsigned char)c) || (c == '.' && p+1 < end && isdigit((unsigned char)p[1]))) &&
+	       (n == 0 || !isIdentChar(fp[n-1]))) {
+      /* number, also hexadecimal and with exponent */
+      for (p++; p < end; p++) {
+	if (isalnum((unsigned char)*p) || *p == '.') continue;
+	if ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E')) continue;
+	break;
+      }
+      fp[n++] = '?';
     } else {
-      handle=(MysqlTclHandle *)Tcl_GetHashValue(entryPtr);
+      fp[n++] = *p++;
     }
-    if (!handle) {
-        if (interp != NULL)
-	  return TCL_ERROR;
+  }
+  fp[n] = '\0';
+  return n;
+}
+
+/* bucket of histogram for value */
+static int histBucket(Tcl_WideInt value)
+{
+  int e, idx;
+
+  if (value < 16) return (value < 0) ? 0 : (int)value;
+  for (e = 4; e < 62 && (value >> (e+1)) != 0; e++);
+  idx = (e-3)*8 + (int)(value >> (e-3));
+  return (idx < MYSQL_HIST_BUCKETS) ? idx : MYSQL_HIST_BUCKETS-1;
+}
+
+/* smallest and highest value of bucket */
+static Tcl_WideInt histBucketLow(int idx)
+{
+  if (idx < 16) return idx;
+  return (Tcl_WideInt)(idx%8+8) << (idx/8-1);
+}
+
+static Tcl_WideInt histBucketHigh(int idx)
+{
+  if (idx < 16) return idx;
+  return ((Tcl_WideInt)(idx%8+9) << (idx/8-1))-1;
+}
+
+/*
+ * Histogram of fingerprint of statement; it is created if needed.
+ */
+static MysqlHistogram *findHistogram(MysqltclState *statePtr,const char *sql,int length)
+{
+  char fp[MYSQL_FINGERPRINT_LEN];
+  Tcl_HashEntry *entryPtr;
+  MysqlHistogram *histogram;
+  int newflag;
+
+  sqlFingerprint(sql,length,fp);
+  entryPtr = Tcl_CreateHashEntry(&statePtr->histograms,fp,&newflag);
+  if (newflag) {
+    histogram = (MysqlHistogram *)Tcl_Alloc(sizeof(MysqlHistogram));
+    memset(histogram,0,sizeof(MysqlHistogram));
+    Tcl_SetHashValue(entryPtr,histogram);
+  }
+  return (MysqlHistogram *)Tcl_GetHashValue(entryPtr);
+}
+
+/*
+ * Start of statement for trace and histogram (if they are on).
+ */
+static void stmtBegin(MysqlTclHandle *handle,const char *sql,int length,int encoded)
+{
+  MysqltclState *statePtr = handle->statePtr;
+
+  handle->traceSeq = 0;
+  handle->histogram = NULL;
+  if (statePtr == NULL || (statePtr->trace == NULL && !statePtr->histogramOn)) return;
+  if (sql == NULL) length = 0;
+  if (statePtr->trace != NULL) traceBegin(handle,sql,length,encoded);
+  if (statePtr->histogramOn) {
+    handle->histogram = findHistogram(statePtr,sql,length);
+    handle->histGeneration = statePtr->histGeneration;
+    handle->histValue = -1;
+  }
+  handle->stmtClock = monotonicMicros();
+}
+
+/*
+ * End of statement for trace and histogram; rows is set if it is not
+ * negative. Can be called again if the result is stored later, the
+ * duration in histogram is replaced then.
+ */
+static void stmtEnd(MysqlTclHandle *handle,Tcl_WideInt rows,int error)
+{
+  MysqlTraceEntry *entry = traceEntry(handle->statePtr,handle->traceSeq);
+  MysqlHistogram *histogram = handle->histogram;
+  Tcl_WideInt duration;
+  int idx;
+
+  if (histogram != NULL && handle->histGeneration != handle->statePtr->histGeneration)
+    histogram = handle->histogram = NULL;
+  if (entry == NULL && histogram == NULL) return;
+  duration = monotonicMicros()-handle->stmtClock;
+  if (entry != NULL) traceEnd(handle,entry,duration,rows,error);
+  if (histogram != NULL) {
+    if (handle->histValue >= 0) {
+      histogram->count--;
+      histogram->sum -= handle->histValue;
+      histogram->buckets[histBucket(handle->histValue)]--;
+    }
+    idx = histBucket(duration);
+    histogram->count++;
+    histogram->sum += duration;
+    histogram->buckets[idx]++;
+    handle->histValue = duration;
+  }
+}
+
+/* store result of statement, the time counts as server time */
+static MYSQL_RES *storeResult(MysqlTclHandle *handle)
+{
+  MYSQL_RES *result;
+  Tcl_WideInt start = statsStart(handle);
+
+  result = mysql_store_result(handle->connection);
+  statsServerTime(handle,start);
+  stmtEnd(handle,(result != NULL) ? (Tcl_WideInt)mysql_num_rows(result) : -1,
+	  mysql_errno(handle->connection));
+  return result;
+}
+
+/*
+ * Put new handle into free slot of state and set its number.
+ * Returns TCL_ERROR if all slots are used.
+ */
+static int registerHandle(MysqltclState *statePtr,MysqlTclHandle *handle)
+{
+  MysqlHandleSlot *slot;
+  int index;
+
+  if (statePtr->freeSlot >= 0) {
+    index = statePtr->freeSlot;
+    statePtr->freeSlot = statePtr->slots[index].nextFree;
+  } else {
+    if (statePtr->slotsUsed > MYSQL_SLOT_MASK)
+      return TCL_ERROR;
+    if (statePtr->slotsUsed == statePtr->slotCount) {
+      statePtr->slotCount = (statePtr->slotCount == 0) ? 16 : statePtr->slotCount*2;
+      statePtr->slots = (MysqlHandleSlot *)Tcl_Realloc((char *)statePtr->slots,
+						       sizeof(MysqlHandleSlot)*statePtr->slotCount);
     }
+    index = statePtr->slotsUsed++;
+    statePtr->slots[index].generation = 0;
+  }
+  slot = &statePtr->slots[index];
+  slot->handle = handle;
+  slot->nextFree = -1;
+  handle->number = ((Tcl_WideInt)slot->generation << MYSQL_SLOT_BITS) | index;
+  handle->statePtr = statePtr;
+  return TCL_OK;
+}
+
+/*
+ * Free slot of closed handle.
+ */
+static void unregisterHandle(MysqltclState *statePtr,MysqlTclHandle *handle)
+{
+  MysqlHandleSlot *slot;
+  int index = (int)(handle->number & MYSQL_SLOT_MASK);
+
+  if (index >= statePtr->slotsUsed || statePtr->slots[index].handle != handle) return;
+  slot = &statePtr->slots[index];
+  slot->handle = NULL;
+  slot->generation++;
+  slot->nextFree = statePtr->freeSlot;
+  statePtr->freeSlot = index;
+}
+
+/*
+ * Return open handle with number or NULL.
+ */
+static MysqlTclHandle *findHandle(MysqltclState *statePtr,Tcl_WideInt number)
+{
+  MysqlTclHandle *handle;
+  int index = (int)(number & MYSQL_SLOT_MASK);
+
+  if (statePtr == NULL || number < 0 || index >= statePtr->slotsUsed) return NULL;
+  handle = statePtr->slots[index].handle;
+  return (handle != NULL && handle->number == number) ? handle : NULL;
+}
+
+/*
+ * Parse handle name "mysqlN" or "queryN" to handle number.
+ * Returns 0 if it is not a handle name.
+ */
+static int parseHandleName(CONST char *string,int length,Tcl_WideInt *numberPtr,int *queryPtr)
+{
+  Tcl_WideInt number = 0;
+  int i;
+
+  if (length <= MYSQL_HPREFIX_LEN || length > MYSQL_HPREFIX_LEN+18) return 0;
+  if (strncmp(string, MysqlHandlePrefix, MYSQL_HPREFIX_LEN) == 0) {
+    *queryPtr = 0;
+  } else if (strncmp(string, "query", MYSQL_HPREFIX_LEN) == 0) {
+    *queryPtr = 1;
+  } else {
+    return 0;
+  }
+  /* the name is unique, no leading zeros */
+  if (string[MYSQL_HPREFIX_LEN] == '0' && length > MYSQL_HPREFIX_LEN+1) return 0;
+  for (i = MYSQL_HPREFIX_LEN; i < length; i++) {
+    if (string[i] < '0' || string[i] > '9') return 0;
+    number = number*10 + (string[i]-'0');
+  }
+  *numberPtr = number;
+  return 1;
+}
+
+static int MysqlHandleSet(Tcl_Interp *interp, register Tcl_Obj *objPtr)
+{
+    Tcl_ObjType *oldTypePtr = objPtr->typePtr;
+    char *string;
+    MysqlTclHandle *handle;
+    Tcl_WideInt number;
+    int length, query;
+
+    string = Tcl_GetStringFromObj(objPtr, &length);  
+    if (!parseHandleName(string,length,&number,&query)) return TCL_ERROR;
+    /* only names of open handles are converted */
+    handle = findHandle(getMysqltclState(interp),number);
+    if (handle == NULL || (handle->type==HT_QUERY) != query) return TCL_ERROR;
+
     if ((oldTypePtr != NULL) && (oldTypePtr->freeIntRepProc != NULL)) {
         oldTypePtr->freeIntRepProc(objPtr);
     }
     
-    objPtr->internalRep.otherValuePtr = (MysqlTclHandle *) handle;
+    objPtr->internalRep.wideValue = number;
     objPtr->typePtr = &mysqlHandleType;
-    Tcl_Preserve((char *)handle);
     return TCL_OK;
 }
 static int MysqlNullSet(Tcl_Interp *interp, Tcl_Obj *objPtr)
@@ -201,43 +911,37 @@ static void UpdateStringOfNull(Tcl_Obj *objPtr) {
 	strcpy(objPtr->bytes,state->MysqlNullvalue);
 	objPtr->length = valueLen;
 }
-static void MysqlHandleFree(Tcl_Obj *obj)
-{
-  MysqlTclHandle *handle = (MysqlTclHandle *)obj->internalRep.otherValuePtr;
-  Tcl_Release((char *)handle);
-}
 
+/*
+ * Handle of object. Objects of closed handles give closedHandle.
+ */
 static int GetHandleFromObj(Tcl_Interp *interp,Tcl_Obj *objPtr,MysqlTclHandle **handlePtr)
 {
+    MysqlTclHandle *handle;
+
     if (Tcl_ConvertToType(interp, objPtr, &mysqlHandleType) != TCL_OK)
         return TCL_ERROR;
-    *handlePtr = (MysqlTclHandle *)objPtr->internalRep.otherValuePtr;
+    handle = findHandle(getMysqltclState(interp),objPtr->internalRep.wideValue);
+    *handlePtr = (handle != NULL) ? handle : &closedHandle;
     return TCL_OK;
 }
 
 static Tcl_Obj *Tcl_NewHandleObj(MysqltclState *statePtr,MysqlTclHandle *handle)
 {
     register Tcl_Obj *objPtr;
-    char buffer[MYSQL_HPREFIX_LEN+TCL_DOUBLE_SPACE+1];
+    char buffer[MYSQL_HPREFIX_LEN+TCL_INTEGER_SPACE*2+1];
     register int len;
-    Tcl_HashEntry *entryPtr;
-    int newflag;
 
     objPtr=Tcl_NewObj();
     /* the string for "query" can not be longer as MysqlHandlePrefix see buf variable */
-    len=sprintf(buffer, "%s%d", (handle->type==HT_QUERY) ? "query" : MysqlHandlePrefix,handle->number);    
+    len=sprintf(buffer, "%s%" TCL_LL_MODIFIER "d", (handle->type==HT_QUERY) ? "query" : MysqlHandlePrefix,handle->number);    
     objPtr->bytes = Tcl_Alloc((unsigned) len + 1);
     strcpy(objPtr->bytes, buffer);
     objPtr->length = len;
     
-    entryPtr=Tcl_CreateHashEntry(&statePtr->hash,buffer,&newflag);
-    Tcl_SetHashValue(entryPtr,handle);     
-  
-    objPtr->internalRep.otherValuePtr = handle;
+    objPtr->internalRep.wideValue = handle->number;
     objPtr->typePtr = &mysqlHandleType;
 
-    Tcl_Preserve((char *)handle);  
-
     return objPtr;
 }
 
@@ -278,6 +982,25 @@ static void set_statusArr(Tcl_Interp *interp,char *elem_name,Tcl_Obj *tobj)
   Tcl_SetVar2Ex (interp,MYSQL_STATUS_ARR,elem_name,tobj,TCL_GLOBAL_ONLY); 
 }
 
+/*
+ *-----------------------------------------------------------
+ * set_statusCode
+ * Sets mysqlstatus(code). In lazy status mode the code of successful
+ * commands is only kept in the state; the read trace of mysqlstatus(code)
+ * (Mysqltcl_StatusTrace) copies it into the array. Conflicts are always
+ * written to the array.
+ */
+
+static void set_statusCode(Tcl_Interp *interp,MysqltclState *statePtr,int code)
+{
+  if (statePtr == NULL) statePtr = getMysqltclState(interp);
+  if (statePtr != NULL && statePtr->statusLazy) {
+    statePtr->statusCode = code;
+    if (code == 0) return;
+  }
+  set_statusArr(interp,MYSQL_STATUS_CODE,Tcl_NewIntObj(code));
+}
+
 /*
  *----------------------------------------------------------------------
  * clear_msg
@@ -306,12 +1029,43 @@ static void mysql_reassemble(Tcl_Interp *interp,int objc,Tcl_Obj *CONST objv[])
    set_statusArr(interp,MYSQL_STATUS_CMD,Tcl_NewListObj(objc, objv));
 }
 
+/*
+ * release the per result column data (see getColumnNames and getColumnPlan)
+ */
+static void freeColumnNames(MysqlTclHandle *handle)
+{
+	int i;
+	if (handle->colPlan != NULL) {
+		Tcl_Free(handle->colPlan);
+		handle->colPlan = NULL;
+	}
+	if (handle->rowObjv != NULL) {
+		Tcl_Free((char *)handle->rowObjv);
+		handle->rowObjv = NULL;
+	}
+	if (handle->colNames != NULL) {
+		for (i = 0; i < handle->colNamesCount; i++) {
+			Tcl_DecrRefCount(handle->colNames[i]);
+		}
+		Tcl_Free((char *)handle->colNames);
+		handle->colNames = NULL;
+		handle->colNamesCount = 0;
+	}
+}
+
 /*
  * free result from handle and consume left result of multresult statement 
  */
 static void freeResult(MysqlTclHandle *handle)
 {
 	MYSQL_RES* result;
+	freeColumnNames(handle);
+	handle->resultTyped = handle->typed;
+	if (handle->convBufSize > MYSQL_CONVBUF_KEEP) {
+		Tcl_Free(handle->convBuf);
+		handle->convBuf = NULL;
+		handle->convBufSize = 0;
+	}
 	if (handle->result != NULL) {
 		mysql_free_result(handle->result);
 		handle->result = NULL ;
@@ -335,7 +1089,7 @@ static void freeResult(MysqlTclHandle *handle)
 
 static int mysql_prim_confl(Tcl_Interp *interp,int objc,Tcl_Obj *CONST objv[],char *msg)
 {
-  set_statusArr(interp,MYSQL_STATUS_CODE,Tcl_NewIntObj(-1));
+  set_statusCode(interp,NULL,-1);
 
   Tcl_ResetResult(interp) ;
   Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
@@ -356,13 +1110,14 @@ static int mysql_prim_confl(Tcl_Interp *interp,int objc,Tcl_Obj *CONST objv[],ch
  * If no error occurs it returns TCL_OK
  */
 
-static int mysql_server_confl(Tcl_Interp *interp,int objc,Tcl_Obj *CONST objv[],MYSQL * connection)
+static int mysql_server_confl(Tcl_Interp *interp,int objc,Tcl_Obj *CONST objv[],MYSQL * connection,MysqlTclHandle *handle)
 {
   const char* mysql_errorMsg;
   if (mysql_errno(connection)) {
     mysql_errorMsg = mysql_error(connection);
 
-    set_statusArr(interp,MYSQL_STATUS_CODE,Tcl_NewIntObj(mysql_errno(connection)));
+    set_statusCode(interp,NULL,mysql_errno(connection));
+    statsError(handle);
 
 
     Tcl_ResetResult(interp) ;
@@ -392,6 +1147,10 @@ static  MysqlTclHandle *get_handle(Tcl_Interp *interp,int objc,Tcl_Obj *CONST ob
       mysql_prim_confl(interp,objc,objv,"handle already closed (dangling pointer)") ;
       return NULL;
   }
+  if (ownerHandle(handle)->async != NULL) {
+      mysql_prim_confl(interp,objc,objv,"asynchronous query pending") ;
+      return NULL;
+  }
   if (check_level==CL_CONN) return handle;
   if (check_level!=CL_RES) {
     if (handle->database[0] == '\0') {
@@ -407,102 +1166,642 @@ static  MysqlTclHandle *get_handle(Tcl_Interp *interp,int objc,Tcl_Obj *CONST ob
   return handle;
 }
 
-/*----------------------------------------------------------------------
+/*
+ * True if Tcl encoding of handle is utf-8.
+ * Tcl strings are (modified) utf-8, so text needs in most cases no conversion.
+ */
+static int isUtf8Handle(MysqlTclHandle *handle)
+{
+  return handle->encoding != NULL && strcmp(Tcl_GetEncodingName(handle->encoding), "utf-8") == 0;
+}
 
- * mysql_QueryTclObj
- * This to method control how tcl data is transfered to mysql and
- * how data is imported into tcl from mysql
- * Return value : Zero on success, Non-zero if an error occurred.
+/*
+ * Compute the conversion of one result column from its type and charset.
  */
-static int mysql_QueryTclObj(MysqlTclHandle *handle,Tcl_Obj *obj)
+static char columnConversion(MysqlTclHandle *handle,MYSQL_FIELD *field,int typed,int utf8)
 {
-  char *query;
-  int result,queryLen;
+  char conversion;
+
+  switch (field->type) {
+  case FIELD_TYPE_TINY:
+  case FIELD_TYPE_SHORT:
+  case FIELD_TYPE_LONG:
+  case FIELD_TYPE_INT24:
+  case FIELD_TYPE_LONGLONG:
+  case FIELD_TYPE_YEAR:
+    conversion = typed ? CONV_WIDEINT : CONV_ASCII;
+    break;
+  case FIELD_TYPE_FLOAT:
+  case FIELD_TYPE_DOUBLE:
+    conversion = typed ? CONV_DOUBLE : CONV_ASCII;
+    break;
+  case FIELD_TYPE_DECIMAL:
+#if MYSQL_VERSION_ID >= 50000
+  case MYSQL_TYPE_NEWDECIMAL:
+#endif
+  case FIELD_TYPE_TIMESTAMP:
+  case FIELD_TYPE_DATE:
+  case FIELD_TYPE_TIME:
+  case FIELD_TYPE_DATETIME:
+  case FIELD_TYPE_NEWDATE:
+    conversion = CONV_ASCII;
+    break;
+#if (MYSQL_VERSION_ID >= 50708) && !defined(MARIADB_BASE_VERSION)
+  case MYSQL_TYPE_JSON:
+    /* reported with binary charset but always utf8mb4 text */
+    conversion = CONV_TEXT;
+    break;
+#endif
+  default:
+    conversion = (field->charsetnr == MYSQL_BINARY_CHARSETNR) ? CONV_BINARY : CONV_TEXT;
+  }
+  if (handle->encoding == NULL && conversion != CONV_WIDEINT && conversion != CONV_DOUBLE) {
+    conversion = CONV_BINARY;
+  } else if (utf8 && conversion == CONV_TEXT) {
+    conversion = CONV_UTF8;
+  }
+  return conversion;
+}
 
-  Tcl_DString queryDS;
+/*
+ * Compute the conversion for every column of the current result into
+ * handle->colPlan.
+ */
+static void fillColumnPlan(MysqlTclHandle *handle)
+{
+  MYSQL_FIELD *fields;
+  int i, utf8;
 
-  query=Tcl_GetStringFromObj(obj, &queryLen);
+  utf8 = isUtf8Handle(handle);
+  fields = mysql_fetch_fields(handle->result);
+  for (i = 0; i < handle->col_count; i++) {
+    handle->colPlan[i] = columnConversion(handle,&fields[i],handle->resultTyped,utf8);
+  }
+}
 
+/*
+ * Return the conversion for every column of the current result.
+ * The plan is computed once per result from MYSQL_FIELD (type and charset)
+ * and is used by all fetch paths (see getRowCellAsObject).
+ */
+static char *getColumnPlan(MysqlTclHandle *handle)
+{
+  if (handle->colPlan == NULL) {
+    handle->colPlan = Tcl_Alloc(handle->col_count+1);
+    fillColumnPlan(handle);
+  }
+  return handle->colPlan;
+}
+
+/*
+ * Parse decimal digits delivered by server into wide integer.
+ * Returns 0 if the value does not fit (for example BIGINT UNSIGNED).
+ */
+static int parseWideInt(const char *str,int length,Tcl_WideInt *valuePtr)
+{
+  const char *end = str+length;
+  Tcl_WideUInt value = 0, limit;
+  int negative = 0;
+
+  if (str<end && (*str=='-' || *str=='+')) {
+    negative = (*str=='-');
+    str++;
+  }
+  if (str==end) return 0;
+  limit = (((Tcl_WideUInt)1)<<63) - (negative ? 0 : 1);
+  for (; str<end; str++) {
+    if (*str<'0' || *str>'9') return 0;
+    if (value > (limit - (*str-'0'))/10) return 0;
+    value = value*10 + (*str-'0');
+  }
+  *valuePtr = negative ? (Tcl_WideInt)(0-value) : (Tcl_WideInt)value;
+  return 1;
+}
+
+/*
+ * Return the length of the leading part of str that is pure ASCII
+ * without NUL. Uses SSE2/AVX2 if the compiler targets it.
+ */
+static int asciiPrefixLength(const unsigned char *str,int length)
+{
+  int i = 0;
+#if defined(__AVX2__)
+  __m256i zero32 = _mm256_setzero_si256();
+  __m256i v32;
+  for (; i+32 <= length; i += 32) {
+    v32 = _mm256_loadu_si256((const __m256i *)(str+i));
+    if (_mm256_movemask_epi8(v32) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v32, zero32)))
+      break;
+  }
+#endif
+#if defined(__SSE2__)
+  {
+    __m128i zero16 = _mm_setzero_si128();
+    __m128i v16;
+    for (; i+16 <= length; i += 16) {
+      v16 = _mm_loadu_si128((const __m128i *)(str+i));
+      if (_mm_movemask_epi8(v16) | _mm_movemask_epi8(_mm_cmpeq_epi8(v16, zero16)))
+        break;
+    }
+  }
+#endif
+  for (; i < length; i++) {
+    if (str[i] == 0 || str[i] >= 0x80) break;
+  }
+  return i;
+}
+
+/*
+ * Check that utf-8 text can be used as Tcl string without conversion.
+ * This is true for well formed utf-8 with characters of basic multilingual
+ * plane and without NUL (Tcl stores NUL and 4 byte sequences in other form).
+ */
+static int isTclUtf(const unsigned char *str,int length)
+{
+  int i = 0;
+  unsigned char c;
+
+  while (i < length) {
+    i += asciiPrefixLength(str+i, length-i);
+    if (i >= length) break;
+    c = str[i];
+    if (c >= 0xC2 && c <= 0xDF) {
+      if (i+1 >= length || (str[i+1]&0xC0) != 0x80) return 0;
+      i += 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      if (i+2 >= length || (str[i+1]&0xC0) != 0x80 || (str[i+2]&0xC0) != 0x80) return 0;
+      /* overlong forms and surrogates */
+      if ((c == 0xE0 && str[i+1] < 0xA0) || (c == 0xED && str[i+1] >= 0xA0)) return 0;
+      i += 3;
+    } else {
+      /* NUL, 4 byte sequences and invalid bytes */
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Convert text from connection encoding to Tcl string object.
+ * The conversion buffer of handle is reused for all cells.
+ */
+static Tcl_Obj *externalToUtfObj(MysqlTclHandle *handle,const char *src,int length)
+{
+  int srcRead, dstWrote, dstChars, size, result;
+
+  /* every byte gives at most TCL_UTF_MAX bytes, so one pass is usual */
+  size = length*TCL_UTF_MAX+TCL_UTF_MAX+1;
+  for (;;) {
+    if (handle->convBufSize < size) {
+      if (handle->convBuf != NULL) Tcl_Free(handle->convBuf);
+      handle->convBuf = Tcl_Alloc(size);
+      handle->convBufSize = size;
+    }
+    result = Tcl_ExternalToUtf(NULL, handle->encoding, src, length,
+			       TCL_ENCODING_START|TCL_ENCODING_END, NULL,
+			       handle->convBuf, handle->convBufSize,
+			       &srcRead, &dstWrote, &dstChars);
+    if (result != TCL_CONVERT_NOSPACE) break;
+    size = handle->convBufSize*2;
+  }
+  handleStats(handle)->decoded += length;
+  return Tcl_NewStringObj(handle->convBuf, dstWrote);
+}
+
+/*----------------------------------------------------------------------
+
+ * mysql_QueryTclObj
+ * This to method control how tcl data is transfered to mysql and
+ * how data is imported into tcl from mysql
+ * Return value : Zero on success, Non-zero if an error occurred.
+ */
+
+/*
+ * Send statement to server, all statements of mysqltcl go this way.
+ * With async only the statement is sent, the result must be read by
+ * mysql_read_query_result.
+ */
+static int mysql_sendQuery(MysqlTclHandle *handle,const char *query,int queryLen,int async)
+{
+  Tcl_WideInt start;
+  int result;
+
+  stmtBegin(handle,query,queryLen,1);
+  start = statsStart(handle);
+  if (async)
+    result = mysql_send_query(handle->connection,query,queryLen);
+  else
+    result = mysql_real_query(handle->connection,query,queryLen);
+  statsServerTime(handle,start);
+  statsQuery(handle,queryLen);
+  if (!async) {
+    stmtEnd(handle,(result == 0 && mysql_field_count(handle->connection) == 0) ?
+	    (Tcl_WideInt)mysql_affected_rows(handle->connection) : -1,
+	    mysql_errno(handle->connection));
+  }
+  return result;
+}
+
+/*
+ * Return statement text of obj in connection encoding. This is the string
+ * of obj or the query buffer of handle (see releaseQueryBuf).
+ */
+static char *encodeTclObj(MysqlTclHandle *handle,Tcl_Obj *obj,int *lengthPtr)
+{
+  char *query;
+  int result,queryLen,size,srcRead,dstWrote,dstChars;
 
   if (handle->encoding==NULL) {
+    return (char *) Tcl_GetByteArrayFromObj(obj, lengthPtr);
+  }
+  /* pure byte array with ASCII only is the same for utf-8 */
+  if (obj->bytes==NULL && obj->typePtr==byteArrayType && isUtf8Handle(handle)) {
     query = (char *) Tcl_GetByteArrayFromObj(obj, &queryLen);
-    result =  mysql_real_query(handle->connection,query,queryLen);
-  } else {
-    Tcl_UtfToExternalDString(handle->encoding, query, -1, &queryDS);
-    queryLen = Tcl_DStringLength(&queryDS); 
-    result =  mysql_real_query(handle->connection,Tcl_DStringValue(&queryDS),queryLen);
-    Tcl_DStringFree(&queryDS);
+    if (asciiPrefixLength((unsigned char *)query,queryLen)==queryLen) {
+      *lengthPtr = queryLen;
+      return query;
+    }
+  }
+  query=Tcl_GetStringFromObj(obj, &queryLen);
+  if (isUtf8Handle(handle) && isTclUtf((unsigned char *)query,queryLen)) {
+    *lengthPtr = queryLen;
+    return query;
+  }
+
+  /* convert into the query buffer of handle, it is kept for next statements */
+  size = queryLen+TCL_UTF_MAX*4;
+  for (;;) {
+    if (handle->queryBufSize < size) {
+      if (handle->queryBuf != NULL) Tcl_Free(handle->queryBuf);
+      handle->queryBuf = Tcl_Alloc(size);
+      handle->queryBufSize = size;
+    }
+    result = Tcl_UtfToExternal(NULL, handle->encoding, query, queryLen,
+			       TCL_ENCODING_START|TCL_ENCODING_END, NULL,
+			       handle->queryBuf, handle->queryBufSize,
+			       &srcRead, &dstWrote, &dstChars);
+    if (result != TCL_CONVERT_NOSPACE) break;
+    size = handle->queryBufSize*2;
+  }
+  handle->encodedBytes += dstWrote;
+  handleStats(handle)->encoded += dstWrote;
+  *lengthPtr = dstWrote;
+  return handle->queryBuf;
+}
+
+/*
+ * Release query buffer of handle after big statements
+ */
+static void releaseQueryBuf(MysqlTclHandle *handle)
+{
+  if (handle->queryBufSize > MYSQL_QUERYBUF_KEEP) {
+    Tcl_Free(handle->queryBuf);
+    handle->queryBuf = NULL;
+    handle->queryBufSize = 0;
   }
+}
+
+static int mysql_SendTclObj(MysqlTclHandle *handle,Tcl_Obj *obj,int async)
+{
+  char *query;
+  int result,queryLen;
+
+  query = encodeTclObj(handle,obj,&queryLen);
+  result = mysql_sendQuery(handle,query,queryLen,async);
+  releaseQueryBuf(handle);
   return result;
 } 
-static Tcl_Obj *getRowCellAsObject(MysqltclState *mysqltclState,MysqlTclHandle *handle,MYSQL_ROW row,int length) 
+
+static int mysql_QueryTclObj(MysqlTclHandle *handle,Tcl_Obj *obj)
 {
-  Tcl_Obj *obj;
+  return mysql_SendTclObj(handle,obj,0);
+}
+
+/*
+ * Convert one cell of row to Tcl object.
+ * conversion is the entry of column plan (see getColumnPlan).
+ */
+static Tcl_Obj *getRowCellAsObject(MysqltclState *mysqltclState,MysqlTclHandle *handle,MYSQL_ROW row,int length,int conversion) 
+{
+  Tcl_WideInt wideValue;
+  double doubleValue;
+  char *end;
+
+  if (*row == NULL) {
+    return Mysqltcl_NewNullObj(mysqltclState);
+  }
+  switch (conversion) {
+  case CONV_WIDEINT:
+    if (parseWideInt(*row,length,&wideValue))
+      return Tcl_NewWideIntObj(wideValue);
+    return Tcl_NewStringObj(*row,length);
+  case CONV_DOUBLE:
+    doubleValue = strtod(*row,&end);
+    if (length>0 && end==*row+length)
+      return Tcl_NewDoubleObj(doubleValue);
+    return Tcl_NewStringObj(*row,length);
+  case CONV_ASCII:
+    return Tcl_NewStringObj(*row,length);
+  case CONV_BINARY:
+    return Tcl_NewByteArrayObj((unsigned char *)*row,length);
+  case CONV_UTF8:
+    if (isTclUtf((unsigned char *)*row,length))
+      return Tcl_NewStringObj(*row,length);
+    break;
+  }
+  return externalToUtfObj(handle, *row, length);
+}
+
+/*
+ * Return the column names of the current result as Tcl objects.
+ * The objects are created once per result and shared as keys by all rows
+ * returned as dicts.
+ */
+static Tcl_Obj **getColumnNames(MysqlTclHandle *handle)
+{
+  MYSQL_FIELD *fields;
   Tcl_DString ds;
+  Tcl_Obj *obj;
+  int i;
 
-  if (*row) {
-    if (handle->encoding!=NULL) {
-      Tcl_ExternalToUtfDString(handle->encoding, *row, length, &ds);
-      obj = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
-      Tcl_DStringFree(&ds);
-    } else {
-      obj = Tcl_NewByteArrayObj((unsigned char *)*row,length);
+  if (handle->colNames == NULL) {
+    fields = mysql_fetch_fields(handle->result);
+    handle->colNames = (Tcl_Obj **)Tcl_Alloc(sizeof(Tcl_Obj *)*(handle->col_count+1));
+    for (i = 0; i < handle->col_count; i++) {
+      if (handle->encoding!=NULL) {
+        Tcl_ExternalToUtfDString(handle->encoding, fields[i].name, -1, &ds);
+        obj = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+        Tcl_DStringFree(&ds);
+      } else {
+        obj = Tcl_NewStringObj(fields[i].name, -1);
+      }
+      Tcl_IncrRefCount(obj);
+      handle->colNames[i] = obj;
     }
-  } else {
-    obj = Mysqltcl_NewNullObj(mysqltclState);
-  } 
-  return obj;
+    handle->colNamesCount = handle->col_count;
+  }
+  return handle->colNames;
+}
+
+/*
+ * Build one row as Tcl dict with column names as keys.
+ * If a column name occurs several times in the result the last column wins.
+ */
+static Tcl_Obj *getRowAsDict(MysqltclState *mysqltclState,MysqlTclHandle *handle,MYSQL_ROW row,unsigned long *lengths)
+{
+  Tcl_Obj *dict;
+  Tcl_Obj **names;
+  char *plan;
+  int i;
+  Tcl_WideInt start = statsStart(handle);
+
+  names = getColumnNames(handle);
+  plan = getColumnPlan(handle);
+  dict = Tcl_NewDictObj();
+  for (i = 0; i < handle->col_count; i++, row++) {
+    Tcl_DictObjPut(NULL, dict, names[i], getRowCellAsObject(mysqltclState,handle,row,lengths[i],plan[i]));
+  }
+  statsRow(handle,lengths);
+  statsConvertTime(handle,start);
+  return dict;
+}
+
+/*
+ * Convert all cells of row into the scratch array of handle.
+ * The array is allocated once per result; the objects can be passed
+ * directly to Tcl_NewListObj.
+ */
+static Tcl_Obj **getRowObjv(MysqltclState *mysqltclState,MysqlTclHandle *handle,MYSQL_ROW row,unsigned long *lengths)
+{
+  char *plan;
+  int i;
+  Tcl_WideInt start = statsStart(handle);
+
+  plan = getColumnPlan(handle);
+  if (handle->rowObjv == NULL) {
+    handle->rowObjv = (Tcl_Obj **)Tcl_Alloc(sizeof(Tcl_Obj *)*(handle->col_count+1));
+  }
+  for (i = 0; i < handle->col_count; i++, row++) {
+    handle->rowObjv[i] = getRowCellAsObject(mysqltclState,handle,row,lengths[i],plan[i]);
+  }
+  statsRow(handle,lengths);
+  statsConvertTime(handle,start);
+  return handle->rowObjv;
+}
+
+/*
+ * Build one row as Tcl list with exact size.
+ */
+static Tcl_Obj *getRowAsList(MysqltclState *mysqltclState,MysqlTclHandle *handle,MYSQL_ROW row,unsigned long *lengths)
+{
+  return Tcl_NewListObj(handle->col_count, getRowObjv(mysqltclState,handle,row,lengths));
+}
+
+/*
+ * Resolve binding list once per call.
+ * The name objects are referenced, so they keep their cached variable
+ * lookup even if the script changes the binding list.
+ */
+static void initVarBinding(MysqlVarBinding *binding,int listObjc,Tcl_Obj **listObjv)
+{
+  int idx;
+
+  binding->count = 0;
+  binding->column = (int *)Tcl_Alloc(sizeof(int)*(listObjc+1));
+  binding->varNames = (Tcl_Obj **)Tcl_Alloc(sizeof(Tcl_Obj *)*(listObjc+1));
+  for (idx = 0; idx < listObjc; idx++) {
+    if (Tcl_GetString(listObjv[idx])[0] == '-') continue;
+    Tcl_IncrRefCount(listObjv[idx]);
+    binding->column[binding->count] = idx;
+    binding->varNames[binding->count] = listObjv[idx];
+    binding->count++;
+  }
+}
+
+static void freeVarBinding(MysqlVarBinding *binding)
+{
+  int i;
+
+  for (i = 0; i < binding->count; i++) {
+    Tcl_DecrRefCount(binding->varNames[i]);
+  }
+  Tcl_Free((char *)binding->column);
+  Tcl_Free((char *)binding->varNames);
+}
+
+/*
+ * Set the bound variables to the cells of row.
+ */
+static int setBoundVars(MysqltclState *mysqltclState,Tcl_Interp *interp,MysqlTclHandle *handle,MysqlVarBinding *binding,MYSQL_ROW row,unsigned long *lengths)
+{
+  char *plan;
+  int i, col;
+
+  statsRow(handle,lengths);
+  plan = getColumnPlan(handle);
+  for (i = 0; i < binding->count; i++) {
+    col = binding->column[i];
+    if (Tcl_ObjSetVar2(interp, binding->varNames[i], NULL,
+		       getRowCellAsObject(mysqltclState,handle,row+col,lengths[col],plan[col]),
+		       TCL_LEAVE_ERR_MSG) == NULL)
+      return TCL_ERROR;
+  }
+  return TCL_OK;
 }
 
+/*
+ * New handle; NULL if there are too many handles (see MYSQL_SLOT_BITS).
+ */
 static MysqlTclHandle *createMysqlHandle(MysqltclState *statePtr) 
 {
   MysqlTclHandle *handle;
   handle=(MysqlTclHandle *)Tcl_Alloc(sizeof(MysqlTclHandle));
   memset(handle,0,sizeof(MysqlTclHandle));
-  if (handle == 0) {
-    panic("no memory for handle");
-    return handle;
-  }
   handle->type = HT_CONNECTION;
 
   /* MT-safe, because every thread in tcl has own interpreter */
-  handle->number=statePtr->handleNum++;
+  if (registerHandle(statePtr,handle) != TCL_OK) {
+    Tcl_Free((char *)handle);
+    return NULL;
+  }
   return handle;
 }
 
 static MysqlTclHandle *createHandleFrom(MysqltclState *statePtr,MysqlTclHandle *handle,enum MysqlHandleType handleType)
 {
-  int number;
+  Tcl_WideInt number;
   MysqlTclHandle *qhandle;
   qhandle = createMysqlHandle(statePtr);
+  if (!qhandle) return qhandle;
   /* do not overwrite the number */
   number = qhandle->number;
-  if (!qhandle) return qhandle;
   memcpy(qhandle,handle,sizeof(MysqlTclHandle));
   qhandle->type=handleType;
   qhandle->number=number;
+  /* result data belongs to the origin handle */
+  qhandle->result=NULL;
+  qhandle->colNames=NULL;
+  qhandle->colNamesCount=0;
+  qhandle->colPlan=NULL;
+  qhandle->rowObjv=NULL;
+  qhandle->convBuf=NULL;
+  qhandle->convBufSize=0;
+  qhandle->queryBuf=NULL;
+  qhandle->queryBufSize=0;
+  qhandle->encodedBytes=0;
+  memset(&qhandle->stats,0,sizeof(MysqlStats));
+  qhandle->traceSeq=0;
+  qhandle->histogram=NULL;
+  qhandle->async=NULL;
+  qhandle->pool=NULL;
+  /* the new handle is child of the connection handle */
+  qhandle->parent = (handle->type==HT_CONNECTION) ? handle : handle->parent;
+  qhandle->firstChild = NULL;
+  qhandle->prevSibling = NULL;
+  qhandle->nextSibling = NULL;
+  if (qhandle->parent != NULL) {
+    qhandle->nextSibling = qhandle->parent->firstChild;
+    if (qhandle->nextSibling != NULL) qhandle->nextSibling->prevSibling = qhandle;
+    qhandle->parent->firstChild = qhandle;
+  }
   return qhandle;
 }
-static void closeHandle(MysqlTclHandle *handle)
+/*
+ * Pending query was sent by a child that is closed now: the owner takes
+ * over the trace entry and histogram of the statement.
+ */
+static void asyncHandOver(MysqlAsync *async)
 {
-  freeResult(handle);
-  if (handle->type==HT_CONNECTION) {
-    mysql_close(handle->connection);
+  MysqlTclHandle *handle = async->handle, *owner = async->owner;
+
+  owner->traceSeq = handle->traceSeq;
+  owner->stmtClock = handle->stmtClock;
+  owner->histogram = handle->histogram;
+  owner->histGeneration = handle->histGeneration;
+  owner->histValue = handle->histValue;
+  async->handle = owner;
+}
+
+static void freeAsync(MysqlAsync *async)
+{
+#ifndef _WINDOWS
+  Tcl_DeleteFileHandler(async->fd);
+#endif
+  async->owner->async = NULL;
+  Tcl_DecrRefCount(async->callback);
+  Tcl_DecrRefCount(async->command);
+  Tcl_Free((char *)async);
+}
+
+static void poolCheckin(MysqlPool *pool,MysqlTclHandle *handle,int reusable);
+static void poolClose(MysqlPool *pool);
+#ifdef PREPARED_STATEMENT
+static void releaseStatement(MysqlTclHandle *handle);
+static void freeStmtCache(MysqlStmtCache *cache);
+static void flushStmtCache(MysqlStmtCache *cache);
+static void fillStatementPlan(MysqlTclHandle *handle,MysqlStatement *stmt);
+#endif
+
+static void closeHandle(MysqltclState *statePtr,MysqlTclHandle *handle)
+{
+  MysqlTclHandle *child;
+  int reusable = 1;
+  unregisterHandle(statePtr,handle);
+  addStats(&statePtr->closedStats,&handle->stats);
+  if (handle->parent != NULL && handle->parent->async != NULL && handle->parent->async->handle == handle) {
+    /* the connection finishes the pending query of closed child */
+    asyncHandOver(handle->parent->async);
+  }
+  /* remove from children of connection; children left open lose their parent */
+  if (handle->parent != NULL) {
+    if (handle->prevSibling != NULL) {
+      handle->prevSibling->nextSibling = handle->nextSibling;
+    } else {
+      handle->parent->firstChild = handle->nextSibling;
+    }
+    if (handle->nextSibling != NULL) handle->nextSibling->prevSibling = handle->prevSibling;
+    handle->parent = NULL;
+  }
+  for (child = handle->firstChild; child != NULL; child = child->nextSibling) {
+    child->parent = NULL;
+  }
+  handle->firstChild = NULL;
+  if (handle->async!=NULL) {
+    /* the pending result is discarded by mysql_close */
+    freeAsync(handle->async);
+    reusable = 0;
+  } else {
+    freeResult(handle);
+  }
+  if (handle->convBuf!=NULL) {
+    Tcl_Free(handle->convBuf);
+    handle->convBuf = NULL;
+    handle->convBufSize = 0;
+  }
+  if (handle->queryBuf!=NULL) {
+    Tcl_Free(handle->queryBuf);
+    handle->queryBuf = NULL;
+    handle->queryBufSize = 0;
   }
 #ifdef PREPARED_STATEMENT
-  if (handle->type==HT_STATEMENT) {
-    if (handle->statement!=NULL)
-	    mysql_stmt_close(handle->statement);
-	if (handle->bindResult!=NULL)
-		Tcl_Free((char *)handle->bindResult);
-    if (handle->bindParam!=NULL)
-    	Tcl_Free((char *)handle->bindParam);
-    if (handle->resultMetadata!=NULL)
-	    mysql_free_result(handle->resultMetadata);
-    if (handle->paramMetadata!=NULL)
-	    mysql_free_result(handle->paramMetadata);
+  if (handle->type==HT_STATEMENT && handle->stmt!=NULL) {
+    /* statement goes back to cache or is closed */
+    releaseStatement(handle);
+  }
+  if (handle->type==HT_CONNECTION && handle->stmtCache!=NULL) {
+    freeStmtCache(handle->stmtCache);
+    handle->stmtCache = NULL;
   }
 #endif
+  if (handle->type==HT_CONNECTION) {
+    if (handle->pool!=NULL) {
+      /* pooled connections are returned to pool */
+      poolCheckin(handle->pool,handle,reusable);
+      handle->pool = NULL;
+    } else {
+      mysql_close(handle->connection);
+    }
+  }
   handle->connection = (MYSQL *)NULL;
   if (handle->encoding!=NULL && handle->type==HT_CONNECTION)
   {
@@ -512,6 +1811,18 @@ static void closeHandle(MysqlTclHandle *handle)
   Tcl_EventuallyFree((char *)handle,TCL_DYNAMIC);
 }
 
+/*
+ * Close handle with all its queries and statements.
+ */
+static void closeHandleWithQueries(MysqltclState *statePtr,MysqlTclHandle *handle)
+{
+  /* all queries and statements on this handle are its children */
+  while (handle->firstChild != NULL) {
+    closeHandle(statePtr,handle->firstChild);
+  }
+  closeHandle(statePtr,handle);
+}
+
 /*
  *----------------------------------------------------------------------
  * mysql_prologue
@@ -530,19 +1841,22 @@ static void closeHandle(MysqlTclHandle *handle)
 
 static MysqlTclHandle *mysql_prologue(Tcl_Interp *interp,int objc,Tcl_Obj *CONST objv[],int req_min_args,int req_max_args,int check_level,char *usage_msg)
 {
+  MysqlTclHandle *handle;
+
   /* Check number of args. */
   if (objc < req_min_args || objc > req_max_args) {
       Tcl_WrongNumArgs(interp, 1, objv, usage_msg);
       return NULL;
   }
 
-  /* Reset mysqlstatus(code). */
-  set_statusArr(interp,MYSQL_STATUS_CODE,Tcl_NewIntObj(0));
-
   /* Check the handle.
    * The function is assumed to set the status array on conflict.
    */
-  return (get_handle(interp,objc,objv,check_level));
+  handle = get_handle(interp,objc,objv,check_level);
+
+  /* Reset mysqlstatus(code). */
+  if (handle != NULL) set_statusCode(interp,handle->statePtr,0);
+  return handle;
 }
 
 /*
@@ -665,23 +1979,16 @@ static Tcl_Obj *mysql_colinfo(Tcl_Interp *interp,int objc,Tcl_Obj *CONST objv[],
 static void Mysqltcl_CloseAll(ClientData clientData)
 {
   MysqltclState *statePtr = (MysqltclState *)clientData; 
-  Tcl_HashSearch search;
   MysqlTclHandle *handle;
-  Tcl_HashEntry *entryPtr; 
-  int wasdeleted=0;
-
-  for (entryPtr=Tcl_FirstHashEntry(&statePtr->hash,&search); 
-       entryPtr!=NULL;
-       entryPtr=Tcl_NextHashEntry(&search)) {
-    wasdeleted=1;
-    handle=(MysqlTclHandle *)Tcl_GetHashValue(entryPtr);
-
-    if (handle->connection == 0) continue;
-    closeHandle(handle);
-  }
-  if (wasdeleted) {
-    Tcl_DeleteHashTable(&statePtr->hash);
-    Tcl_InitHashTable(&statePtr->hash, TCL_STRING_KEYS);
+  int i, pass;
+
+  /* queries and statements first, they use the connection */
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < statePtr->slotsUsed; i++) {
+      handle = statePtr->slots[i].handle;
+      if (handle == NULL || (handle->type==HT_CONNECTION) != pass) continue;
+      closeHandle(statePtr,handle);
+    }
   }
 }
 /*
@@ -695,14 +2002,43 @@ static void Mysqltcl_Kill(ClientData clientData)
    Tcl_HashEntry *entryPtr; 
    MysqlTclHandle *handle;
    Tcl_HashSearch search; 
+   int i, pass;
 
-   for (entryPtr=Tcl_FirstHashEntry(&statePtr->hash,&search); 
+   /* pools with checked out connections are freed by closing of handles;
+      shared pools stay open for other threads */
+   for (entryPtr=Tcl_FirstHashEntry(&statePtr->pools,&search); 
        entryPtr!=NULL;
        entryPtr=Tcl_NextHashEntry(&search)) {
-     handle=(MysqlTclHandle *)Tcl_GetHashValue(entryPtr);
-     if (handle->connection == 0) continue;
-     closeHandle(handle);
-   } 
+     Tcl_MutexLock(&((MysqlPool *)Tcl_GetHashValue(entryPtr))->mutex);
+     poolClose((MysqlPool *)Tcl_GetHashValue(entryPtr));
+   }
+   Tcl_DeleteHashTable(&statePtr->pools);
+
+   /* queries and statements first, they use the connection */
+   for (pass = 0; pass < 2; pass++) {
+     for (i = 0; i < statePtr->slotsUsed; i++) {
+       handle = statePtr->slots[i].handle;
+       if (handle == NULL || (handle->type==HT_CONNECTION) != pass) continue;
+       closeHandle(statePtr,handle);
+     }
+   }
+   if (statePtr->slots != NULL) {
+     Tcl_Free((char *)statePtr->slots);
+   }
+   Tcl_DeleteAssocData(statePtr->interp, MYSQL_ASSOC_KEY);
+   /* the array is not written while the interpreter is deleted */
+   if (statePtr->statusLazy) {
+     Tcl_UntraceVar2(statePtr->interp, MYSQL_STATUS_ARR, MYSQL_STATUS_CODE, TCL_GLOBAL_ONLY|TCL_TRACE_READS,
+		     Mysqltcl_StatusTrace, (ClientData)statePtr);
+   }
+   if (statePtr->trace != NULL) {
+     freeTrace(statePtr->trace);
+   }
+   if (statePtr->traceAsync != NULL) {
+     Tcl_AsyncDelete(statePtr->traceAsync);
+   }
+   deleteHistograms(statePtr,NULL);
+   Tcl_DeleteHashTable(&statePtr->histograms);
    Tcl_Free(statePtr->MysqlNullvalue);
    Tcl_Free((char *)statePtr); 
 }
@@ -728,34 +2064,55 @@ static CONST char* MysqlConnectOpt[] =
       "-multistatement","-multiresult",
 #endif
       "-localfiles","-ignorespace","-foundrows","-interactive","-sslkey","-sslcert",
-      "-sslca","-sslcapath","-sslciphers",NULL
+      "-sslca","-sslcapath","-sslciphers","-typed","-stmtcache",NULL
     };
 
-static int Mysqltcl_Connect(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+/*
+ * Copy string option into params (see parseConnectOptions)
+ */
+static void setParam(char **paramPtr,Tcl_Obj *obj)
 {
-  MysqltclState *statePtr = (MysqltclState *)clientData; 
-  int        i, idx;
-  char *hostname = NULL;
-  char *user = NULL;
-  char *password = NULL;
-  char *db = NULL;
-  int port = 0, flags = 0, booleanflag;
-  char *socket = NULL;
-  char *encodingname = NULL;
+  int len;
+  char *value = Tcl_GetStringFromObj(obj,&len);
+  if (*paramPtr != NULL) Tcl_Free(*paramPtr);
+  *paramPtr = Tcl_Alloc(len+1);
+  memcpy(*paramPtr,value,len+1);
+}
 
-#if (MYSQL_VERSION_ID >= 40107)
-  int isSSL = 0;
-#endif
-  char *sslkey = NULL;
-  char *sslcert = NULL;
-  char *sslca = NULL;
-  char *sslcapath = NULL;
-  char *sslcipher = NULL;
-  
-  MysqlTclHandle *handle;
-  const char *groupname = "mysqltcl";
+static void freeConnectParams(MysqlConnectParams *params)
+{
+  char **strings[11];
+  int i;
+
+  strings[0] = &params->hostname;
+  strings[1] = &params->user;
+  strings[2] = &params->password;
+  strings[3] = &params->db;
+  strings[4] = &params->socket;
+  strings[5] = &params->encodingname;
+  strings[6] = &params->sslkey;
+  strings[7] = &params->sslcert;
+  strings[8] = &params->sslca;
+  strings[9] = &params->sslcapath;
+  strings[10] = &params->sslcipher;
+  for (i = 0; i < 11; i++) {
+    if (*strings[i] != NULL) {
+      Tcl_Free(*strings[i]);
+      *strings[i] = NULL;
+    }
+  }
+}
+
+/*
+ * Parse the options of mysql::connect from objv[first] on.
+ * The strings are copied, so params can be used for later connects
+ * (see connection pools). Must be released by freeConnectParams.
+ */
+static int parseConnectOptions(Tcl_Interp *interp,int objc,Tcl_Obj *CONST objv[],int first,MysqlConnectParams *params)
+{
+  int        i, idx;
+  int booleanflag;
 
-  
   enum connectoption {
     MYSQL_CONNHOST_OPT, MYSQL_CONNUSER_OPT, MYSQL_CONNPASSWORD_OPT, 
     MYSQL_CONNDB_OPT, MYSQL_CONNPORT_OPT, MYSQL_CONNSOCKET_OPT, MYSQL_CONNENCODING_OPT,
@@ -765,160 +2122,200 @@ static int Mysqltcl_Connect(ClientData clientData, Tcl_Interp *interp, int objc,
 #endif
     MYSQL_LOCALFILES_OPT,MYSQL_IGNORESPACE_OPT,
     MYSQL_FOUNDROWS_OPT,MYSQL_INTERACTIVE_OPT,MYSQL_SSLKEY_OPT,MYSQL_SSLCERT_OPT,
-    MYSQL_SSLCA_OPT,MYSQL_SSLCAPATH_OPT,MYSQL_SSLCIPHERS_OPT
+    MYSQL_SSLCA_OPT,MYSQL_SSLCAPATH_OPT,MYSQL_SSLCIPHERS_OPT,MYSQL_TYPED_OPT,
+    MYSQL_STMTCACHE_OPT
   };
 
-  if (!(objc & 1) || 
-    objc>(sizeof(MysqlConnectOpt)/sizeof(MysqlConnectOpt[0]-1)*2+1)) {
-    Tcl_WrongNumArgs(interp, 1, objv, "[-user xxx] [-db mysql] [-port 3306] [-host localhost] [-socket sock] [-password pass] [-encoding encoding] [-ssl boolean] [-compress boolean] [-odbc boolean] [-noschema boolean]"
-    );
-	return TCL_ERROR;
-  }
-              
-  for (i = 1; i < objc; i++) {
+  memset(params,0,sizeof(MysqlConnectParams));
+  for (i = first; i < objc; i++) {
     if (Tcl_GetIndexFromObj(interp, objv[i], MysqlConnectOpt, "option",
                           0, &idx) != TCL_OK)
-      return TCL_ERROR;
+      goto error;
     
     switch (idx) {
     case MYSQL_CONNHOST_OPT:
-      hostname = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->hostname,objv[++i]);
       break;
     case MYSQL_CONNUSER_OPT:
-      user = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->user,objv[++i]);
       break;
     case MYSQL_CONNPASSWORD_OPT:
-      password = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->password,objv[++i]);
       break;
     case MYSQL_CONNDB_OPT:
-      db = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->db,objv[++i]);
       break;
     case MYSQL_CONNPORT_OPT:
-      if (Tcl_GetIntFromObj(interp, objv[++i], &port) != TCL_OK)
-	return TCL_ERROR;
+      if (Tcl_GetIntFromObj(interp, objv[++i], &params->port) != TCL_OK)
+	goto error;
       break;
     case MYSQL_CONNSOCKET_OPT:
-      socket = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->socket,objv[++i]);
       break;
     case MYSQL_CONNENCODING_OPT:
-      encodingname = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->encodingname,objv[++i]);
       break;
     case MYSQL_CONNSSL_OPT:
 #if (MYSQL_VERSION_ID >= 40107)
-      if (Tcl_GetBooleanFromObj(interp,objv[++i],&isSSL) != TCL_OK )
-	return TCL_ERROR;
+      if (Tcl_GetBooleanFromObj(interp,objv[++i],&params->isSSL) != TCL_OK )
+	goto error;
 #else
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-        flags |= CLIENT_SSL;
+        params->flags |= CLIENT_SSL;
 #endif
       break;
     case MYSQL_CONNCOMPRESS_OPT:
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-	flags |= CLIENT_COMPRESS;
+	params->flags |= CLIENT_COMPRESS;
       break;
     case MYSQL_CONNNOSCHEMA_OPT: 
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-	flags |= CLIENT_NO_SCHEMA;
+	params->flags |= CLIENT_NO_SCHEMA;
       break;
     case MYSQL_CONNODBC_OPT:
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-	flags |= CLIENT_ODBC;
+	params->flags |= CLIENT_ODBC;
       break;
 #if (MYSQL_VERSION_ID >= 40107)
     case MYSQL_MULTISTATEMENT_OPT:
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-	flags |= CLIENT_MULTI_STATEMENTS;
+	params->flags |= CLIENT_MULTI_STATEMENTS;
       break;
     case MYSQL_MULTIRESULT_OPT:
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-	flags |= CLIENT_MULTI_RESULTS;
+	params->flags |= CLIENT_MULTI_RESULTS;
       break;
 #endif
     case MYSQL_LOCALFILES_OPT:
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-	flags |= CLIENT_LOCAL_FILES;
+	params->flags |= CLIENT_LOCAL_FILES;
       break;
     case MYSQL_IGNORESPACE_OPT:
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-	flags |= CLIENT_IGNORE_SPACE;
+	params->flags |= CLIENT_IGNORE_SPACE;
       break;
     case MYSQL_FOUNDROWS_OPT:
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-	flags |= CLIENT_FOUND_ROWS;
+	params->flags |= CLIENT_FOUND_ROWS;
       break;
     case MYSQL_INTERACTIVE_OPT:
       if (Tcl_GetBooleanFromObj(interp,objv[++i],&booleanflag) != TCL_OK )
-	return TCL_ERROR;
+	goto error;
       if (booleanflag)
-	flags |= CLIENT_INTERACTIVE;
+	params->flags |= CLIENT_INTERACTIVE;
       break;
     case MYSQL_SSLKEY_OPT:
-      sslkey = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->sslkey,objv[++i]);
       break;
     case MYSQL_SSLCERT_OPT:
-      sslcert = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->sslcert,objv[++i]);
       break;
     case MYSQL_SSLCA_OPT:
-      sslca = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->sslca,objv[++i]);
       break;
     case MYSQL_SSLCAPATH_OPT:
-      sslcapath = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->sslcapath,objv[++i]);
       break;
     case MYSQL_SSLCIPHERS_OPT:
-      sslcipher = Tcl_GetStringFromObj(objv[++i],NULL);
+      setParam(&params->sslcipher,objv[++i]);
+      break;
+    case MYSQL_TYPED_OPT:
+      if (Tcl_GetBooleanFromObj(interp,objv[++i],&params->typed) != TCL_OK )
+	goto error;
+      break;
+    case MYSQL_STMTCACHE_OPT:
+      if (Tcl_GetIntFromObj(interp,objv[++i],&params->stmtCacheSize) != TCL_OK )
+	goto error;
+      if (params->stmtCacheSize < 0) {
+	mysql_prim_confl(interp,objc,objv,"statement cache size must not be negative");
+	goto error;
+      }
       break;
     default:
-      return mysql_prim_confl(interp,objc,objv,"Weirdness in options");            
+      mysql_prim_confl(interp,objc,objv,"Weirdness in options");
+      goto error;
     }
   }
 
-  handle = createMysqlHandle(statePtr);
-
-  if (handle == 0) {
-    panic("no memory for handle");
-    return TCL_ERROR;
+  return TCL_OK;
+error:
+  freeConnectParams(params);
+  return TCL_ERROR;
+}
 
-  }
+/*
+ * Open new server connection with params.
+ * Returns 0 on error; *connectionPtr is set also in this case and must
+ * be closed by caller.
+ */
+static int openConnection(MysqlConnectParams *params,MYSQL **connectionPtr)
+{
+  const char *groupname = "mysqltcl";
+  MYSQL *connection;
 
-  handle->connection = mysql_init(NULL);
+  *connectionPtr = connection = mysql_init(NULL);
 
   /* the function below caused in version pre 3.23.50 segmentation fault */
 #if (MYSQL_VERSION_ID>=32350)
-  mysql_options(handle->connection,MYSQL_READ_DEFAULT_GROUP,groupname);
+  mysql_options(connection,MYSQL_READ_DEFAULT_GROUP,groupname);
+#endif
+#if (MYSQL_VERSION_ID >= 40102)
+  /* newer client libraries refuse LOAD DATA LOCAL unless it is enabled here */
+  if (params->flags & CLIENT_LOCAL_FILES) {
+      unsigned int localInfile = 1;
+      mysql_options(connection,MYSQL_OPT_LOCAL_INFILE,&localInfile);
+  }
 #endif
 #if (MYSQL_VERSION_ID >= 40107)
-  if (isSSL) {
-      mysql_ssl_set(handle->connection,sslkey,sslcert, sslca, sslcapath, sslcipher);
+  if (params->isSSL) {
+      mysql_ssl_set(connection,params->sslkey,params->sslcert, params->sslca, params->sslcapath, params->sslcipher);
   }
 #endif
 
-  if (!mysql_real_connect(handle->connection, hostname, user,
-                                password, db, port, socket, flags)) {
-      mysql_server_confl(interp,objc,objv,handle->connection);
-      closeHandle(handle);
-      return TCL_ERROR;
+  return mysql_real_connect(connection, params->hostname, params->user,
+                                params->password, params->db, params->port, params->socket, params->flags) != NULL;
+}
+
+/*
+ * Set database, encoding and typed of new connection handle from params.
+ */
+static int initConnectionHandle(Tcl_Interp *interp,MysqlTclHandle *handle,MysqlConnectParams *params)
+{
+  char *encodingname = params->encodingname;
+
+  handle->typed = handle->resultTyped = params->typed;
+  handle->multiStatements = (params->flags & CLIENT_MULTI_STATEMENTS) != 0;
+  handle->stats.threadId = mysql_thread_id(handle->connection);
+#ifdef PREPARED_STATEMENT
+  if (params->stmtCacheSize > 0) {
+    handle->stmtCache = (MysqlStmtCache *)Tcl_Alloc(sizeof(MysqlStmtCache));
+    memset(handle->stmtCache,0,sizeof(MysqlStmtCache));
+    Tcl_InitHashTable(&handle->stmtCache->table, TCL_STRING_KEYS);
+    handle->stmtCache->size = params->stmtCacheSize;
+    handle->stmtCache->threadId = mysql_thread_id(handle->connection);
   }
+#endif
 
-  if (db) {
-    strncpy(handle->database, db, MYSQL_NAME_LEN) ;
+  if (params->db) {
+    strncpy(handle->database, params->db, MYSQL_NAME_LEN) ;
     handle->database[MYSQL_NAME_LEN - 1] = '\0' ;
   }
 
@@ -929,6 +2326,45 @@ static int Mysqltcl_Connect(ClientData clientData, Tcl_Interp *interp, int objc,
     if (handle->encoding == NULL)
       return TCL_ERROR;
   }
+  return TCL_OK;
+}
+
+static int Mysqltcl_Connect(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData; 
+  MysqlConnectParams params;
+  MysqlTclHandle *handle;
+
+  if (!(objc & 1) || 
+    objc>(sizeof(MysqlConnectOpt)/sizeof(MysqlConnectOpt[0]-1)*2+1)) {
+    Tcl_WrongNumArgs(interp, 1, objv, "[-user xxx] [-db mysql] [-port 3306] [-host localhost] [-socket sock] [-password pass] [-encoding encoding] [-ssl boolean] [-compress boolean] [-odbc boolean] [-noschema boolean]"
+    );
+	return TCL_ERROR;
+  }
+
+  if (parseConnectOptions(interp,objc,objv,1,&params) != TCL_OK)
+    return TCL_ERROR;
+
+  handle = createMysqlHandle(statePtr);
+
+  if (handle == 0) {
+    freeConnectParams(&params);
+    return mysql_prim_confl(interp,objc,objv,MYSQL_TOO_MANY_HANDLES);
+  }
+
+  if (!openConnection(&params,&handle->connection)) {
+      mysql_server_confl(interp,objc,objv,handle->connection,handle);
+      closeHandle(statePtr,handle);
+      freeConnectParams(&params);
+      return TCL_ERROR;
+  }
+
+  if (initConnectionHandle(interp,handle,&params) != TCL_OK) {
+      closeHandle(statePtr,handle);
+      freeConnectParams(&params);
+      return TCL_ERROR;
+  }
+  freeConnectParams(&params);
 
   Tcl_SetObjResult(interp, Tcl_NewHandleObj(statePtr,handle));
 
@@ -936,6 +2372,421 @@ static int Mysqltcl_Connect(ClientData clientData, Tcl_Interp *interp, int objc,
 
 }
 
+/*
+ * Connection pools
+ * A pool keeps idle connections (MYSQL) with the options of mysql::connect.
+ * mysql::pool checkout takes a connection as normal handle; closing
+ * this handle returns the connection to the pool (see closeHandle).
+ * Shared pools (-shared) are process wide and can be used from handles
+ * of all threads; every pool access is guarded by the mutex of the pool.
+ */
+
+static long poolNow(void)
+{
+  Tcl_Time now;
+  Tcl_GetTime(&now);
+  return now.sec;
+}
+
+/*
+ * Close idle connections over idle timeout, but keep min connections.
+ * The oldest idle connections are at begin. Pool must be locked.
+ */
+static void poolPrune(MysqlPool *pool)
+{
+  long now;
+  int i, n = 0;
+
+  if (pool->idleTimeout <= 0) return;
+  now = poolNow();
+  while (n < pool->idleCount && pool->idleCount - n + pool->active > pool->min &&
+	 now - pool->idleSince[n] >= pool->idleTimeout) {
+    mysql_close(pool->idle[n]);
+    n++;
+  }
+  if (n > 0) {
+    for (i = n; i < pool->idleCount; i++) {
+      pool->idle[i-n] = pool->idle[i];
+      pool->idleSince[i-n] = pool->idleSince[i];
+    }
+    pool->idleCount -= n;
+  }
+}
+
+static void poolCloseIdle(MysqlPool *pool)
+{
+  while (pool->idleCount > 0) {
+    mysql_close(pool->idle[--pool->idleCount]);
+  }
+}
+
+static void freePool(MysqlPool *pool)
+{
+  poolCloseIdle(pool);
+  freeConnectParams(&pool->params);
+  Tcl_MutexFinalize(&pool->mutex);
+  Tcl_Free((char *)pool->idle);
+  Tcl_Free((char *)pool->idleSince);
+  Tcl_Free(pool->name);
+  Tcl_Free((char *)pool);
+}
+
+/*
+ * Give up one active connection and unlock the pool.
+ * A closed pool is freed with its last active connection.
+ */
+static void poolRelease(MysqlPool *pool)
+{
+  int freeIt;
+
+  pool->active--;
+  freeIt = pool->closed && pool->active == 0;
+  Tcl_MutexUnlock(&pool->mutex);
+  if (freeIt) freePool(pool);
+}
+
+/*
+ * Take a connection from locked pool and unlock it. Idle connections are
+ * checked by mysql_ping, a new connection is opened if no idle one is left.
+ * Server round trips are done without lock.
+ * Returns 0 on success, 1 if the pool is exhausted or closed and 2 on connect
+ * error (*connectionPtr is set for error message and must be closed by caller).
+ */
+static int poolCheckout(MysqlPool *pool,MYSQL **connectionPtr)
+{
+  MYSQL *connection;
+
+  if (pool->closed) {
+    Tcl_MutexUnlock(&pool->mutex);
+    return 1;
+  }
+  poolPrune(pool);
+  while (pool->idleCount > 0) {
+    connection = pool->idle[--pool->idleCount];
+    pool->active++;
+    Tcl_MutexUnlock(&pool->mutex);
+    if (mysql_ping(connection) == 0) {
+      *connectionPtr = connection;
+      return 0;
+    }
+    /* broken connection */
+    mysql_close(connection);
+    Tcl_MutexLock(&pool->mutex);
+    pool->active--;
+  }
+  if (pool->active >= pool->max) {
+    Tcl_MutexUnlock(&pool->mutex);
+    return 1;
+  }
+  pool->active++;
+  Tcl_MutexUnlock(&pool->mutex);
+  if (!openConnection(&pool->params,connectionPtr)) {
+    Tcl_MutexLock(&pool->mutex);
+    poolRelease(pool);
+    return 2;
+  }
+  Tcl_MutexLock(&pool->mutex);
+  if (pool->charset[0] == '\0') {
+    strncpy(pool->charset, mysql_character_set_name(*connectionPtr), MYSQL_NAME_LEN);
+    pool->charset[MYSQL_NAME_LEN - 1] = '\0';
+  }
+  Tcl_MutexUnlock(&pool->mutex);
+  return 0;
+}
+
+/*
+ * Reset session state of connection before it is used again:
+ * user variables, temporary tables, transactions, the database and
+ * the character set. The database is selected always, it may be changed
+ * by a USE statement that handle->database does not know.
+ */
+static int poolResetConnection(MysqlPool *pool,MysqlTclHandle *handle)
+{
+#if (MYSQL_VERSION_ID >= 50703)
+  if (mysql_reset_connection(handle->connection)) return 1;
+  if (pool->params.db != NULL && mysql_select_db(handle->connection, pool->params.db)) return 1;
+  if (pool->charset[0] != '\0' && mysql_set_character_set(handle->connection, pool->charset)) return 1;
+  return 0;
+#else
+  return mysql_change_user(handle->connection, pool->params.user,
+			   pool->params.password, pool->params.db) != 0;
+#endif
+}
+
+/*
+ * Return connection of handle to pool (called by closeHandle)
+ */
+static void poolCheckin(MysqlPool *pool,MysqlTclHandle *handle,int reusable)
+{
+  if (reusable && poolResetConnection(pool,handle)) reusable = 0;
+  Tcl_MutexLock(&pool->mutex);
+  if (pool->closed || !reusable) {
+    mysql_close(handle->connection);
+  } else {
+    pool->idle[pool->idleCount] = handle->connection;
+    pool->idleSince[pool->idleCount] = poolNow();
+    pool->idleCount++;
+  }
+  poolRelease(pool);
+}
+
+/*
+ * Close locked pool (already removed from its table) and unlock it;
+ * it is freed after last checkin
+ */
+static void poolClose(MysqlPool *pool)
+{
+  int freeIt;
+
+  poolCloseIdle(pool);
+  pool->closed = 1;
+  freeIt = pool->active == 0;
+  Tcl_MutexUnlock(&pool->mutex);
+  if (freeIt) freePool(pool);
+}
+
+/*
+ * Find pool of interpreter or shared pool by name. The pool is returned
+ * locked, with remove set it is taken out of its table (mysql::pool close).
+ */
+static MysqlPool *findPool(Tcl_Interp *interp,MysqltclState *statePtr,int objc,Tcl_Obj *CONST objv[],Tcl_Obj *nameObj,int remove)
+{
+  Tcl_HashEntry *entryPtr;
+  MysqlPool *pool = NULL;
+
+  entryPtr = Tcl_FindHashEntry(&statePtr->pools,Tcl_GetString(nameObj));
+  if (entryPtr != NULL) {
+    pool = (MysqlPool *)Tcl_GetHashValue(entryPtr);
+    if (remove) Tcl_DeleteHashEntry(entryPtr);
+    Tcl_MutexLock(&pool->mutex);
+    return pool;
+  }
+  Tcl_MutexLock(&mysqltclMutex);
+  entryPtr = Tcl_FindHashEntry(&sharedPools,Tcl_GetString(nameObj));
+  if (entryPtr != NULL) {
+    pool = (MysqlPool *)Tcl_GetHashValue(entryPtr);
+    if (remove) Tcl_DeleteHashEntry(entryPtr);
+    Tcl_MutexLock(&pool->mutex);
+  }
+  Tcl_MutexUnlock(&mysqltclMutex);
+  if (pool == NULL)
+    mysql_prim_confl(interp,objc,objv,"no such pool");
+  return pool;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Pool
+ *    Implements the mysql::pool command:
+ *    usage: mysql::pool create name ?-shared? ?-min n? ?-max n? ?-idletimeout sec? ?connect options?
+ *           mysql::pool checkout name
+ *           mysql::pool checkin handle
+ *           mysql::pool close name
+ *           mysql::pool info name
+ *           mysql::pool names
+ */
+
+static int Mysqltcl_Pool(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData;
+  MysqlPool *pool;
+  MysqlTclHandle *handle;
+  MYSQL *connection;
+  Tcl_HashEntry *entryPtr;
+  Tcl_HashSearch search;
+  Tcl_Obj **connectObjv, *resList;
+  int i, idx, optIdx, connectObjc, newflag, value;
+
+  static CONST char* poolCommands[] = {"create", "checkout", "checkin", "close", "info", "names", NULL};
+  enum poolcommand {POOL_CREATE, POOL_CHECKOUT, POOL_CHECKIN, POOL_CLOSE, POOL_INFO, POOL_NAMES};
+  static CONST char* poolOptions[] = {"-min", "-max", "-idletimeout", "-shared", NULL};
+  enum pooloption {POOL_MIN, POOL_MAX, POOL_IDLETIMEOUT, POOL_SHARED};
+
+  if (objc < 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "create|checkout|checkin|close|info|names ?arg ...?");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], poolCommands, "subcommand",
+			  TCL_EXACT, &idx) != TCL_OK)
+    return TCL_ERROR;
+  if ((idx==POOL_NAMES && objc!=2) || (idx==POOL_CREATE && objc<3) ||
+      (idx!=POOL_NAMES && idx!=POOL_CREATE && objc!=3)) {
+    Tcl_WrongNumArgs(interp, 2, objv, (idx==POOL_CREATE) ? "name ?-shared? ?-min n? ?-max n? ?-idletimeout sec? ?option value ...?" :
+		     (idx==POOL_NAMES) ? "" : (idx==POOL_CHECKIN) ? "handle" : "name");
+    return TCL_ERROR;
+  }
+  set_statusCode(interp,statePtr,0);
+
+  switch (idx) {
+  case POOL_CREATE:
+    Tcl_MutexLock(&mysqltclMutex);
+    i = Tcl_FindHashEntry(&statePtr->pools,Tcl_GetString(objv[2])) != NULL ||
+      Tcl_FindHashEntry(&sharedPools,Tcl_GetString(objv[2])) != NULL;
+    Tcl_MutexUnlock(&mysqltclMutex);
+    if (i)
+      return mysql_prim_confl(interp,objc,objv,"pool already exists");
+    pool = (MysqlPool *)Tcl_Alloc(sizeof(MysqlPool));
+    memset(pool,0,sizeof(MysqlPool));
+    pool->max = 10;
+    /* pool options are removed, the rest are options of mysql::connect */
+    connectObjv = (Tcl_Obj **)Tcl_Alloc(sizeof(Tcl_Obj *)*objc);
+    connectObjc = 0;
+    connectObjv[connectObjc++] = objv[0];
+    for (i = 3; i < objc; i += 2) {
+      if (Tcl_GetIndexFromObj(NULL, objv[i], poolOptions, "option", TCL_EXACT, &optIdx) != TCL_OK) {
+	connectObjv[connectObjc++] = objv[i];
+	if (i+1 < objc) connectObjv[connectObjc++] = objv[i+1];
+	continue;
+      }
+      if (optIdx == POOL_SHARED) {
+	pool->shared = 1;
+	i--;
+	continue;
+      }
+      if (i+1 >= objc) {
+	Tcl_Free((char *)connectObjv);
+	Tcl_Free((char *)pool);
+	return mysql_prim_confl(interp,objc,objv,"option needs value");
+      }
+      value = 0;
+      if (Tcl_GetIntFromObj(interp, objv[i+1], &value) != TCL_OK || value < 0) {
+	Tcl_Free((char *)connectObjv);
+	Tcl_Free((char *)pool);
+	return (value < 0) ? mysql_prim_confl(interp,objc,objv,"pool option must not be negative") : TCL_ERROR;
+      }
+      switch (optIdx) {
+      case POOL_MIN: pool->min = value; break;
+      case POOL_MAX: pool->max = value; break;
+      case POOL_IDLETIMEOUT: pool->idleTimeout = value; break;
+      }
+    }
+    if ((connectObjc & 1) == 0) {
+      Tcl_Free((char *)connectObjv);
+      Tcl_Free((char *)pool);
+      return mysql_prim_confl(interp,objc,objv,"option needs value");
+    }
+    if (pool->max < 1 || pool->min > pool->max) {
+      Tcl_Free((char *)connectObjv);
+      Tcl_Free((char *)pool);
+      return mysql_prim_confl(interp,objc,objv,"pool needs 0 <= min <= max and max >= 1");
+    }
+    i = parseConnectOptions(interp,connectObjc,connectObjv,1,&pool->params);
+    Tcl_Free((char *)connectObjv);
+    if (i != TCL_OK) {
+      Tcl_Free((char *)pool);
+      return TCL_ERROR;
+    }
+    pool->name = Tcl_Alloc(strlen(Tcl_GetString(objv[2]))+1);
+    strcpy(pool->name,Tcl_GetString(objv[2]));
+    pool->idle = (MYSQL **)Tcl_Alloc(sizeof(MYSQL *)*pool->max);
+    pool->idleSince = (long *)Tcl_Alloc(sizeof(long)*pool->max);
+    /* open min connections at once */
+    while (pool->idleCount < pool->min) {
+      if (!openConnection(&pool->params,&connection)) {
+	mysql_server_confl(interp,objc,objv,connection,NULL);
+	mysql_close(connection);
+	freePool(pool);
+	return TCL_ERROR;
+      }
+      pool->idle[pool->idleCount] = connection;
+      pool->idleSince[pool->idleCount] = poolNow();
+      pool->idleCount++;
+    }
+    if (pool->shared) {
+      Tcl_MutexLock(&mysqltclMutex);
+      entryPtr = Tcl_CreateHashEntry(&sharedPools,pool->name,&newflag);
+      if (newflag) Tcl_SetHashValue(entryPtr,pool);
+      Tcl_MutexUnlock(&mysqltclMutex);
+      if (!newflag) {
+	/* created by other thread in the meantime */
+	freePool(pool);
+	return mysql_prim_confl(interp,objc,objv,"pool already exists");
+      }
+    } else {
+      entryPtr = Tcl_CreateHashEntry(&statePtr->pools,pool->name,&newflag);
+      Tcl_SetHashValue(entryPtr,pool);
+    }
+    Tcl_SetObjResult(interp,objv[2]);
+    break;
+  case POOL_CHECKOUT:
+    if ((pool = findPool(interp,statePtr,objc,objv,objv[2],0)) == NULL)
+      return TCL_ERROR;
+    switch (poolCheckout(pool,&connection)) {
+    case 1:
+      return mysql_prim_confl(interp,objc,objv,"pool exhausted or closed");
+    case 2:
+      mysql_server_confl(interp,objc,objv,connection,NULL);
+      mysql_close(connection);
+      return TCL_ERROR;
+    }
+    if ((handle = createMysqlHandle(statePtr)) == NULL) {
+      mysql_close(connection);
+      Tcl_MutexLock(&pool->mutex);
+      poolRelease(pool);
+      return mysql_prim_confl(interp,objc,objv,MYSQL_TOO_MANY_HANDLES);
+    }
+    handle->connection = connection;
+    handle->pool = pool;
+    if (initConnectionHandle(interp,handle,&pool->params) != TCL_OK) {
+      closeHandle(statePtr,handle);
+      return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewHandleObj(statePtr,handle));
+    break;
+  case POOL_CHECKIN:
+    if (GetHandleFromObj(interp, objv[2], &handle) != TCL_OK)
+      return mysql_prim_confl(interp,objc,objv,"not mysqltcl handle");
+    if (handle->connection == 0)
+      return mysql_prim_confl(interp,objc,objv,"handle already closed (dangling pointer)");
+    if (handle->pool == NULL || handle->type != HT_CONNECTION)
+      return mysql_prim_confl(interp,objc,objv,"handle is not from pool");
+    closeHandleWithQueries(statePtr,handle);
+    break;
+  case POOL_CLOSE:
+    if ((pool = findPool(interp,statePtr,objc,objv,objv[2],1)) == NULL)
+      return TCL_ERROR;
+    poolClose(pool);
+    break;
+  case POOL_INFO:
+    if ((pool = findPool(interp,statePtr,objc,objv,objv[2],0)) == NULL)
+      return TCL_ERROR;
+    poolPrune(pool);
+    resList = Tcl_GetObjResult(interp);
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj("min",-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewIntObj(pool->min));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj("max",-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewIntObj(pool->max));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj("idletimeout",-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewIntObj(pool->idleTimeout));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj("idle",-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewIntObj(pool->idleCount));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj("active",-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewIntObj(pool->active));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj("shared",-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewIntObj(pool->shared));
+    Tcl_MutexUnlock(&pool->mutex);
+    break;
+  case POOL_NAMES:
+    resList = Tcl_GetObjResult(interp);
+    for (entryPtr=Tcl_FirstHashEntry(&statePtr->pools,&search); 
+	 entryPtr!=NULL;
+	 entryPtr=Tcl_NextHashEntry(&search)) {
+      Tcl_ListObjAppendElement(interp, resList,
+			       Tcl_NewStringObj(Tcl_GetHashKey(&statePtr->pools,entryPtr),-1));
+    }
+    Tcl_MutexLock(&mysqltclMutex);
+    for (entryPtr=Tcl_FirstHashEntry(&sharedPools,&search); 
+	 entryPtr!=NULL;
+	 entryPtr=Tcl_NextHashEntry(&search)) {
+      Tcl_ListObjAppendElement(interp, resList,
+			       Tcl_NewStringObj(Tcl_GetHashKey(&sharedPools,entryPtr),-1));
+    }
+    Tcl_MutexUnlock(&mysqltclMutex);
+    break;
+  }
+  return TCL_OK;
+}
 
 /*
  *----------------------------------------------------------------------
@@ -966,7 +2817,7 @@ static int Mysqltcl_Use(ClientData clientData, Tcl_Interp *interp, int objc, Tcl
   }
 
   if (mysql_select_db(handle->connection, db)!=0) {
-    return mysql_server_confl(interp,objc,objv,handle->connection);
+    return mysql_server_confl(interp,objc,objv,handle->connection,handle);
   }
   strcpy(handle->database, db);
   return TCL_OK;
@@ -1021,7 +2872,7 @@ static int Mysqltcl_Escape(ClientData clientData, Tcl_Interp *interp, int objc,
  *
  * Mysqltcl_Sel
  *    Implements the mysqlsel command:
- *    usage: mysqlsel handle sel-query ?-list|-flatlist?
+ *    usage: mysqlsel handle sel-query ?-list|-flatlist|-columns|-dicts? ?-typed?
  *	                
  *    results:
  *
@@ -1032,66 +2883,108 @@ static int Mysqltcl_Escape(ClientData clientData, Tcl_Interp *interp, int objc,
 static int Mysqltcl_Sel(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
   MysqltclState *statePtr = (MysqltclState *)clientData; 
-  Tcl_Obj *res, *resList;
+  Tcl_Obj *res;
+  Tcl_Obj **cells;
   MYSQL_ROW row;
   MysqlTclHandle *handle;
   unsigned long *lengths;
+  char *plan;
+  int rowCount, rowIdx, resLen;
 
 
-  static CONST char* selOptions[] = {"-list", "-flatlist", NULL};
-  /* Warning !! no option number */
-  int i,selOption=2,colCount;
+  static CONST char* selOptions[] = {"-list", "-flatlist", "-columns", "-dicts", "-typed", NULL};
+  enum seloption {SEL_LIST, SEL_FLATLIST, SEL_COLUMNS, SEL_DICTS, SEL_TYPED, SEL_NONE};
+  int i,idx,selOption=SEL_NONE,colCount,typed=0;
   
-  if ((handle = mysql_prologue(interp, objc, objv, 3, 4, CL_CONN,
-			    "handle sel-query ?-list|-flatlist?")) == 0)
+  if ((handle = mysql_prologue(interp, objc, objv, 3, 5, CL_CONN,
+			    "handle sel-query ?-list|-flatlist|-columns|-dicts? ?-typed?")) == 0)
     return TCL_ERROR;
 
 
-  if (objc==4) {
-    if (Tcl_GetIndexFromObj(interp, objv[3], selOptions, "option",
-			    TCL_EXACT, &selOption) != TCL_OK)
+  for (i=3; i<objc; i++) {
+    if (Tcl_GetIndexFromObj(interp, objv[i], selOptions, "option",
+			    TCL_EXACT, &idx) != TCL_OK)
       return TCL_ERROR;
+    if (idx==SEL_TYPED) {
+      typed = 1;
+    } else {
+      selOption = idx;
+    }
   }
 
   /* Flush any previous result. */
   freeResult(handle);
+  if (typed) handle->resultTyped = 1;
 
   if (mysql_QueryTclObj(handle,objv[2])) {
-    return mysql_server_confl(interp,objc,objv,handle->connection);
+    return mysql_server_confl(interp,objc,objv,handle->connection,handle);
   }
-  if (selOption<2) {
+  if (selOption==SEL_LIST || selOption==SEL_FLATLIST || selOption==SEL_DICTS) {
     /* If imadiatly result than do not store result in mysql client library cache */
     handle->result = mysql_use_result(handle->connection);
   } else {
-    handle->result = mysql_store_result(handle->connection);
+    /* -columns needs the row count in advance to pre-size the column lists */
+    handle->result = storeResult(handle);
   }
   
   if (handle->result == NULL) {
-    if (selOption==2) Tcl_SetObjResult(interp, Tcl_NewIntObj(-1));
+    if (selOption==SEL_NONE) Tcl_SetObjResult(interp, Tcl_NewIntObj(-1));
   } else {
     colCount = handle->col_count = mysql_num_fields(handle->result);
+    plan = getColumnPlan(handle);
     res = Tcl_GetObjResult(interp);
     handle->res_count = 0;
     switch (selOption) {
-    case 0: /* -list */
+    case SEL_LIST:
       while ((row = mysql_fetch_row(handle->result)) != NULL) {
-	resList = Tcl_NewListObj(0, NULL);
 	lengths = mysql_fetch_lengths(handle->result);
-	for (i=0; i< colCount; i++, row++) {
-	  Tcl_ListObjAppendElement(interp, resList,getRowCellAsObject(statePtr,handle,row,lengths[i]));
-	}
-	Tcl_ListObjAppendElement(interp, res, resList);
+	Tcl_ListObjAppendElement(interp, res, getRowAsList(statePtr,handle,row,lengths));
+      }  
+      break;
+    case SEL_FLATLIST:
+      /* append whole rows at once */
+      resLen = 0;
+      while ((row = mysql_fetch_row(handle->result)) != NULL) {
+	lengths = mysql_fetch_lengths(handle->result);
+	Tcl_ListObjReplace(interp, res, resLen, 0, colCount, getRowObjv(statePtr,handle,row,lengths));
+	resLen += colCount;
       }  
       break;
-    case 1: /* -flatlist */
+    case SEL_DICTS:
       while ((row = mysql_fetch_row(handle->result)) != NULL) {
+	lengths = mysql_fetch_lengths(handle->result);
+	Tcl_ListObjAppendElement(interp, res, getRowAsDict(statePtr,handle,row,lengths));
+      }
+      break;
+    case SEL_COLUMNS:
+      /* one cell array for all columns; column i starts at cells[i*rowCount] */
+      if (colCount>0 && (Tcl_WideUInt)mysql_num_rows(handle->result) > (Tcl_WideUInt)(INT_MAX/sizeof(Tcl_Obj *)/colCount)) {
+	freeResult(handle);
+	return mysql_prim_confl(interp,objc,objv,"result too large for -columns");
+      }
+      rowCount = (int)mysql_num_rows(handle->result);
+      cells = NULL;
+      if (rowCount>0 && colCount>0) {
+	cells = (Tcl_Obj **)Tcl_Alloc(sizeof(Tcl_Obj *)*rowCount*colCount);
+      }
+      rowIdx = 0;
+      while (rowIdx<rowCount && (row = mysql_fetch_row(handle->result)) != NULL) {
 	lengths = mysql_fetch_lengths(handle->result);
 	for (i=0; i< colCount; i++, row++) {
-	  Tcl_ListObjAppendElement(interp, res,getRowCellAsObject(statePtr,handle,row,lengths[i]));
+	  cells[i*rowCount+rowIdx] = getRowCellAsObject(statePtr,handle,row,lengths[i],plan[i]);
 	}
-      }  
+	statsRow(handle,lengths);
+	rowIdx++;
+      }
+      for (i=0; i< colCount; i++) {
+	Tcl_ListObjAppendElement(interp, res,
+				 Tcl_NewListObj(rowIdx, (cells==NULL) ? NULL : cells+i*rowCount));
+      }
+      if (cells!=NULL) {
+	Tcl_Free((char *)cells);
+      }
       break;
-    case 2: /* No option */
+    case SEL_NONE:
       handle->res_count = mysql_num_rows(handle->result);
       Tcl_SetIntObj(res, handle->res_count);
       break;
@@ -1099,10 +2992,97 @@ static int Mysqltcl_Sel(ClientData clientData, Tcl_Interp *interp, int objc, Tcl
   }
   return TCL_OK;
 }
+#ifndef _WINDOWS
+/*
+ * File handler of asynchronous query (mysql::query -async).
+ * Reads the result and calls the callback as
+ *   callback ok queryhandle
+ *   callback ok -1              (statement without result set)
+ *   callback error message
+ * Only the wait for the first packet of the answer is driven by the event
+ * loop; the result set is then read and stored blocking.
+ */
+static void Mysqltcl_AsyncReady(ClientData clientData, int mask)
+{
+  MysqlAsync *async = (MysqlAsync *)clientData;
+  Tcl_Interp *interp = async->interp;
+  MysqlTclHandle *handle = async->handle, *qhandle;
+  MYSQL_RES *result = NULL;
+  Tcl_InterpState interpState;
+  Tcl_Obj *statusObj, *valueObj;
+  Tcl_Obj **prefixObjv, **cmdObjv, **commandObjv;
+  int prefixObjc, commandObjc, i, code;
+
+  Tcl_DeleteFileHandler(async->fd);
+  async->owner->async = NULL;
+  Tcl_Preserve((ClientData)interp);
+  interpState = Tcl_SaveInterpState(interp, TCL_OK);
+
+  if (mysql_read_query_result(handle->connection)) {
+    stmtEnd(handle,-1,mysql_errno(handle->connection));
+  } else if (mysql_field_count(handle->connection) == 0) {
+    stmtEnd(handle,(Tcl_WideInt)mysql_affected_rows(handle->connection),0);
+  } else {
+    result = storeResult(handle);
+  }
+  Tcl_ListObjGetElements(NULL, async->command, &commandObjc, &commandObjv);
+  if (result != NULL && (qhandle = createHandleFrom(async->statePtr,handle,HT_QUERY)) == NULL) {
+    mysql_free_result(result);
+    result = NULL;
+    mysql_prim_confl(interp,commandObjc,commandObjv,MYSQL_TOO_MANY_HANDLES);
+    statusObj = Tcl_NewStringObj("error", -1);
+    valueObj = Tcl_GetObjResult(interp);
+  } else if (result != NULL) {
+    qhandle->result = result;
+    qhandle->resultTyped = async->typed;
+    qhandle->col_count = mysql_num_fields(qhandle->result);
+    qhandle->res_count = mysql_num_rows(qhandle->result);
+    statusObj = Tcl_NewStringObj("ok", -1);
+    valueObj = Tcl_NewHandleObj(async->statePtr,qhandle);
+  } else if (!mysql_errno(handle->connection)) {
+    statusObj = Tcl_NewStringObj("ok", -1);
+    valueObj = Tcl_NewIntObj(-1);
+  } else {
+    mysql_server_confl(interp,commandObjc,commandObjv,handle->connection,handle);
+    statusObj = Tcl_NewStringObj("error", -1);
+    valueObj = Tcl_GetObjResult(interp);
+  }
+
+  Tcl_ListObjGetElements(NULL, async->callback, &prefixObjc, &prefixObjv);
+  cmdObjv = (Tcl_Obj **)Tcl_Alloc(sizeof(Tcl_Obj *)*(prefixObjc+2));
+  for (i = 0; i < prefixObjc; i++) {
+    cmdObjv[i] = prefixObjv[i];
+  }
+  cmdObjv[prefixObjc] = statusObj;
+  cmdObjv[prefixObjc+1] = valueObj;
+  for (i = 0; i < prefixObjc+2; i++) {
+    Tcl_IncrRefCount(cmdObjv[i]);
+  }
+  code = Tcl_EvalObjv(interp, prefixObjc+2, cmdObjv, TCL_EVAL_GLOBAL);
+  if (code == TCL_ERROR) {
+    Tcl_AddErrorInfo(interp, "\n    (mysql::query -async callback)");
+    Tcl_BackgroundError(interp);
+  }
+  for (i = 0; i < prefixObjc+2; i++) {
+    Tcl_DecrRefCount(cmdObjv[i]);
+  }
+  Tcl_Free((char *)cmdObjv);
+
+  Tcl_RestoreInterpState(interp, interpState);
+  Tcl_Release((ClientData)interp);
+  Tcl_DecrRefCount(async->callback);
+  Tcl_DecrRefCount(async->command);
+  Tcl_Free((char *)async);
+}
+#endif
+
 /*
  * Mysqltcl_Query
  * Works as mysqltclsel but return an $query handle that allow to build
  * nested queries on simple handle
+ * usage: mysql::query handle sqlstatement ?-typed? ?-async callback?
+ * With -async the command returns at once, the callback is called from
+ * event loop when the result is read (see Mysqltcl_AsyncReady).
  */
 
 static int Mysqltcl_Query(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
@@ -1110,22 +3090,77 @@ static int Mysqltcl_Query(ClientData clientData, Tcl_Interp *interp, int objc, T
   MysqltclState *statePtr = (MysqltclState *)clientData; 
   MYSQL_RES *result;
   MysqlTclHandle *handle, *qhandle;
+  MysqlAsync *async;
+  Tcl_Obj *callback = NULL;
+  int typed, i, idx, prefixObjc;
+  Tcl_Obj **prefixObjv;
+
+  static CONST char* queryOptions[] = {"-typed", "-async", NULL};
+  enum queryoption {QUERY_TYPED, QUERY_ASYNC};
   
-  if ((handle = mysql_prologue(interp, objc, objv, 3, 3, CL_CONN,
+  if ((handle = mysql_prologue(interp, objc, objv, 3, 6, CL_CONN,
 
-			    "handle sqlstatement")) == 0)
+			    "handle sqlstatement ?-typed? ?-async callback?")) == 0)
     return TCL_ERROR;
+
+  typed = handle->typed;
+  for (i = 3; i < objc; i++) {
+    if (Tcl_GetIndexFromObj(interp, objv[i], queryOptions, "option",
+			    TCL_EXACT, &idx) != TCL_OK)
+      return TCL_ERROR;
+    if (idx==QUERY_TYPED) {
+      typed = 1;
+    } else {
+      if (i+1 >= objc)
+	return mysql_prim_confl(interp,objc,objv,"option -async needs callback");
+      callback = objv[++i];
+      if (Tcl_ListObjGetElements(interp, callback, &prefixObjc, &prefixObjv) != TCL_OK)
+	return TCL_ERROR;
+    }
+  }
+
+  if (callback != NULL) {
+#ifdef _WINDOWS
+    return mysql_prim_confl(interp,objc,objv,FUNCTION_NOT_AVAILABLE);
+#else
+    if (mysql_SendTclObj(handle,objv[2],1)) {
+      return mysql_server_confl(interp,objc,objv,handle->connection,handle);
+    }
+    async = (MysqlAsync *)Tcl_Alloc(sizeof(MysqlAsync));
+    async->interp = interp;
+    async->statePtr = statePtr;
+    async->owner = ownerHandle(handle);
+    async->handle = handle;
+    async->callback = callback;
+    Tcl_IncrRefCount(callback);
+    async->command = Tcl_NewListObj(objc, objv);
+    Tcl_IncrRefCount(async->command);
+    async->typed = typed;
+#ifdef MARIADB_BASE_VERSION
+    async->fd = mysql_get_socket(handle->connection);
+#else
+    async->fd = handle->connection->net.fd;
+#endif
+    async->owner->async = async;
+    Tcl_CreateFileHandler(async->fd, TCL_READABLE, Mysqltcl_AsyncReady, (ClientData)async);
+    return TCL_OK;
+#endif
+  }
        
   if (mysql_QueryTclObj(handle,objv[2])) {
-    return mysql_server_confl(interp,objc,objv,handle->connection);
+    return mysql_server_confl(interp,objc,objv,handle->connection,handle);
   }
 
-  if ((result = mysql_store_result(handle->connection)) == NULL) {
+  if ((result = storeResult(handle)) == NULL) {
     Tcl_SetObjResult(interp, Tcl_NewIntObj(-1));
     return TCL_OK;
   } 
-  if ((qhandle = createHandleFrom(statePtr,handle,HT_QUERY)) == NULL) return TCL_ERROR;
+  if ((qhandle = createHandleFrom(statePtr,handle,HT_QUERY)) == NULL) {
+    mysql_free_result(result);
+    return mysql_prim_confl(interp,objc,objv,MYSQL_TOO_MANY_HANDLES);
+  }
   qhandle->result = result;
+  qhandle->resultTyped = typed;
   qhandle->col_count = mysql_num_fields(qhandle->result) ;
 
 
@@ -1143,7 +3178,6 @@ static int Mysqltcl_Query(ClientData clientData, Tcl_Interp *interp, int objc, T
 static int Mysqltcl_EndQuery(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
   MysqltclState *statePtr = (MysqltclState *)clientData; 
-  Tcl_HashEntry *entryPtr;
   MysqlTclHandle *handle;
   
   if ((handle = mysql_prologue(interp, objc, objv, 2, 2, CL_CONN,
@@ -1151,11 +3185,7 @@ static int Mysqltcl_EndQuery(ClientData clientData, Tcl_Interp *interp, int objc
     return TCL_ERROR;
 
   if (handle->type==HT_QUERY) {
-    entryPtr = Tcl_FindHashEntry(&statePtr->hash,Tcl_GetStringFromObj(objv[1],NULL));
-    if (entryPtr) {
-      Tcl_DeleteHashEntry(entryPtr);
-    }
-    closeHandle(handle);
+    closeHandle(statePtr,handle);
   } else {
       freeResult(handle);
   }
@@ -1189,7 +3219,7 @@ static int Mysqltcl_Exec(ClientData clientData, Tcl_Interp *interp, int objc, Tc
 	freeResult(handle);
 
 	if (mysql_QueryTclObj(handle,objv[2]))
-    	return mysql_server_confl(interp,objc,objv,handle->connection);
+    	return mysql_server_confl(interp,objc,objv,handle->connection,handle);
 
 	if ((affected=mysql_affected_rows(handle->connection)) < 0) affected=0;
 
@@ -1208,47 +3238,803 @@ static int Mysqltcl_Exec(ClientData clientData, Tcl_Interp *interp, int objc, Tc
 	return TCL_OK ;
 }
 
+/*
+ * Build result of one statement of mysql::batch as dict with keys
+ * affected, insertid, warnings and for statements with result set
+ * columns and rows. The result set is read from handle->result.
+ */
+static Tcl_Obj *getBatchResult(MysqltclState *statePtr,MysqlTclHandle *handle)
+{
+  Tcl_Obj *dict, *rows;
+  MYSQL_ROW row;
+  unsigned long *lengths;
 
+  dict = Tcl_NewDictObj();
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("affected", -1),
+		 Tcl_NewWideIntObj((Tcl_WideInt)mysql_affected_rows(handle->connection)));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("insertid", -1),
+		 Tcl_NewWideIntObj((Tcl_WideInt)mysql_insert_id(handle->connection)));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("warnings", -1),
+		 Tcl_NewIntObj(mysql_warning_count(handle->connection)));
+  if (handle->result != NULL) {
+    handle->col_count = mysql_num_fields(handle->result);
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("columns", -1),
+		   Tcl_NewListObj(handle->col_count, getColumnNames(handle)));
+    rows = Tcl_NewListObj(0, NULL);
+    while ((row = mysql_fetch_row(handle->result)) != NULL) {
+      lengths = mysql_fetch_lengths(handle->result);
+      Tcl_ListObjAppendElement(NULL, rows, getRowAsList(statePtr,handle,row,lengths));
+    }
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("rows", -1), rows);
+    freeColumnNames(handle);
+    mysql_free_result(handle->result);
+    handle->result = NULL;
+  }
+  return dict;
+}
 
 /*
  *----------------------------------------------------------------------
  *
- * Mysqltcl_Fetch
- *    Implements the mysqlnext command:
-
- *    usage: mysql::fetch handle
- *	                
+ * Mysqltcl_Batch
+ *    Implements the mysql::batch command:
+ *    usage: mysql::batch handle statementList ?-typed?
+ *
  *    results:
- *	next row from pending results as tcl list, or null list.
+ *	list with one dict for every statement (see getBatchResult).
+ *	All statements are sent in one round trip as multiple statement
+ *	query; multiple statements are enabled for this query if needed.
+ *	The statements after a failed statement are not executed.
  */
 
-static int Mysqltcl_Fetch(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+static int Mysqltcl_Batch(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-  MysqltclState *statePtr = (MysqltclState *)clientData; 
-  MysqlTclHandle *handle;
-  int idx ;
+#if (MYSQL_VERSION_ID < 40107)
+  Tcl_AddErrorInfo(interp, FUNCTION_NOT_AVAILABLE);
+  return TCL_ERROR;
+#else
+  MysqltclState *statePtr = (MysqltclState *)clientData;
+  MysqlTclHandle *handle;
+  Tcl_Obj **stmtObjv, *sqlObj, *resList;
+  char *str;
+  int i, len, idx, stmtCount, status, enabled = 0;
+
+  static CONST char* batchOptions[] = {"-typed", NULL};
+
+  if ((handle = mysql_prologue(interp, objc, objv, 3, 4, CL_CONN,
+			    "handle statementList ?-typed?")) == 0)
+    return TCL_ERROR;
+  if (objc == 4 && Tcl_GetIndexFromObj(interp, objv[3], batchOptions, "option",
+				       TCL_EXACT, &idx) != TCL_OK)
+    return TCL_ERROR;
+  if (Tcl_ListObjGetElements(interp, objv[2], &stmtCount, &stmtObjv) != TCL_OK)
+    return TCL_ERROR;
+  if (stmtCount == 0)
+    return TCL_OK;
+
+  /*
+   * join statements; a terminating ; of statement is optional.
+   * The separator is on its own line, so a statement may end with a -- or # comment
+   */
+  sqlObj = Tcl_NewObj();
+  Tcl_IncrRefCount(sqlObj);
+  for (i = 0; i < stmtCount; i++) {
+    str = Tcl_GetStringFromObj(stmtObjv[i], &len);
+    while (len > 0 && (isspace((unsigned char)str[len-1]) || str[len-1] == ';')) len--;
+    if (len == 0) {
+      Tcl_DecrRefCount(sqlObj);
+      return mysql_prim_confl(interp,objc,objv,"empty statement in list");
+    }
+    if (i > 0) Tcl_AppendToObj(sqlObj, "\n;\n", 3);
+    Tcl_AppendToObj(sqlObj, str, len);
+  }
+
+  freeResult(handle);
+  if (objc == 4) handle->resultTyped = 1;
+  if (stmtCount > 1 && !handle->multiStatements) {
+    if (mysql_set_server_option(handle->connection, MYSQL_OPTION_MULTI_STATEMENTS_ON)) {
+      Tcl_DecrRefCount(sqlObj);
+      return mysql_server_confl(interp,objc,objv,handle->connection,handle);
+    }
+    enabled = 1;
+  }
+  status = mysql_QueryTclObj(handle,sqlObj);
+  Tcl_DecrRefCount(sqlObj);
+
+  resList = Tcl_NewListObj(0, NULL);
+  if (status == 0) {
+    do {
+      handle->result = storeResult(handle);
+      if (handle->result == NULL && mysql_field_count(handle->connection) != 0) {
+	status = 1;
+	break;
+      }
+      Tcl_ListObjAppendElement(NULL, resList, getBatchResult(statePtr,handle));
+    } while ((status = mysql_next_result(handle->connection)) == 0);
+    if (status == -1) status = 0;
+  }
+  if (status != 0) {
+    /* error message before it is reset by set_server_option */
+    mysql_server_confl(interp,objc,objv,handle->connection,handle);
+    Tcl_DecrRefCount(resList);
+  } else {
+    Tcl_SetObjResult(interp, resList);
+  }
+  handle->resultTyped = handle->typed;
+  if (enabled)
+    mysql_set_server_option(handle->connection, MYSQL_OPTION_MULTI_STATEMENTS_OFF);
+  return (status != 0) ? TCL_ERROR : TCL_OK;
+#endif
+}
+
+/*
+ * Return max_allowed_packet of server; it is asked once per connection.
+ * Returns 0 on error.
+ */
+static unsigned long getMaxAllowedPacket(MysqlTclHandle *handle)
+{
+  MYSQL_RES *result;
+  MYSQL_ROW row;
+  static CONST char query[] = "SELECT @@max_allowed_packet";
+
+  if (handle->maxAllowedPacket == 0) {
+    if (mysql_real_query(handle->connection,query,sizeof(query)-1))
+      return 0;
+    if ((result = mysql_store_result(handle->connection)) == NULL)
+      return 0;
+    if ((row = mysql_fetch_row(result)) != NULL && row[0] != NULL)
+      handle->maxAllowedPacket = strtoul(row[0],NULL,10);
+    mysql_free_result(result);
+  }
+  return handle->maxAllowedPacket;
+}
+
+/*
+ * Append SQL text (assignments) in connection encoding.
+ */
+static void appendSqlText(MysqlTclHandle *handle,Tcl_DString *ds,Tcl_Obj *obj)
+{
+  Tcl_DString conv;
+  char *str;
+  int len;
+
+  if (handle->encoding == NULL) {
+    str = (char *)Tcl_GetByteArrayFromObj(obj,&len);
+    Tcl_DStringAppend(ds,str,len);
+    return;
+  }
+  str = Tcl_GetStringFromObj(obj,&len);
+  Tcl_UtfToExternalDString(handle->encoding,str,len,&conv);
+  Tcl_DStringAppend(ds,Tcl_DStringValue(&conv),Tcl_DStringLength(&conv));
+  Tcl_DStringFree(&conv);
+}
+
+/*
+ * Append identifier (table or column name) quoted by backticks in
+ * connection encoding; backticks in the name are doubled. With qualified
+ * a dot separates database and table name.
+ */
+static void appendSqlIdent(MysqlTclHandle *handle,Tcl_DString *ds,Tcl_Obj *obj,int qualified)
+{
+  Tcl_DString quoted, conv;
+  char *str;
+  int len, i;
+
+  /* quoted before conversion, so trail bytes of multibyte characters are not touched */
+  if (handle->encoding == NULL) {
+    str = (char *)Tcl_GetByteArrayFromObj(obj,&len);
+  } else {
+    str = Tcl_GetStringFromObj(obj,&len);
+  }
+  Tcl_DStringInit(&quoted);
+  Tcl_DStringAppend(&quoted,"`",1);
+  for (i = 0; i < len; i++) {
+    if (str[i] == '`') {
+      Tcl_DStringAppend(&quoted,"``",2);
+    } else if (qualified && str[i] == '.') {
+      Tcl_DStringAppend(&quoted,"`.`",3);
+    } else {
+      Tcl_DStringAppend(&quoted,str+i,1);
+    }
+  }
+  Tcl_DStringAppend(&quoted,"`",1);
+  if (handle->encoding == NULL) {
+    Tcl_DStringAppend(ds,Tcl_DStringValue(&quoted),Tcl_DStringLength(&quoted));
+  } else {
+    Tcl_UtfToExternalDString(handle->encoding,Tcl_DStringValue(&quoted),Tcl_DStringLength(&quoted),&conv);
+    Tcl_DStringAppend(ds,Tcl_DStringValue(&conv),Tcl_DStringLength(&conv));
+    Tcl_DStringFree(&conv);
+  }
+  Tcl_DStringFree(&quoted);
+}
+
+/*
+ * Append value as SQL literal in connection encoding: NULL for the null
+ * object, integers as numbers, byte arrays as binary strings and all
+ * other values as strings escaped by mysql_real_escape_string.
+ */
+static void appendSqlValue(MysqlTclHandle *handle,Tcl_DString *ds,Tcl_Obj *obj,int utf8)
+{
+  Tcl_DString conv;
+  Tcl_WideInt wideValue;
+  char *str, *dst, buf[32];
+  int len, start;
+  unsigned long escaped;
+
+  if (obj->typePtr == &mysqlNullType) {
+    Tcl_DStringAppend(ds,"NULL",4);
+    return;
+  }
+  /* only pure integers, 0x10 or 0123 with a string rep is quoted as written */
+  if (obj->bytes == NULL && obj->typePtr != NULL && (obj->typePtr == intType || obj->typePtr == wideIntType) &&
+      Tcl_GetWideIntFromObj(NULL,obj,&wideValue) == TCL_OK) {
+    sprintf(buf, "%" TCL_LL_MODIFIER "d", wideValue);
+    Tcl_DStringAppend(ds,buf,-1);
+    return;
+  }
+  Tcl_DStringInit(&conv);
+  if (obj->bytes == NULL && obj->typePtr == byteArrayType) {
+    str = (char *)Tcl_GetByteArrayFromObj(obj,&len);
+    if (handle->encoding != NULL)
+      Tcl_DStringAppend(ds,"_binary",7);
+  } else if (handle->encoding == NULL) {
+    str = (char *)Tcl_GetByteArrayFromObj(obj,&len);
+  } else {
+    str = Tcl_GetStringFromObj(obj,&len);
+    if (!utf8 || !isTclUtf((unsigned char *)str,len)) {
+      str = Tcl_UtfToExternalDString(handle->encoding,str,len,&conv);
+      len = Tcl_DStringLength(&conv);
+    }
+  }
+  start = Tcl_DStringLength(ds);
+  Tcl_DStringSetLength(ds,start+2*len+3);
+  dst = Tcl_DStringValue(ds)+start;
+  *dst++ = '\'';
+  escaped = mysql_real_escape_string(handle->connection,dst,str,len);
+  dst[escaped] = '\'';
+  Tcl_DStringSetLength(ds,start+(int)escaped+2);
+  Tcl_DStringFree(&conv);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Insert
+ *    Implements the mysql::insert command:
+ *    usage: mysql::insert handle table columnList rowList ?-ignore? ?-onduplicate assignments?
+ *
+ *    results:
+ *	list of number of affected rows and first insert id.
+ *	The rows are sent as multi row INSERT statements that are shorter
+ *	than max_allowed_packet of server. Many statements are sent in one
+ *	transaction if there is none, so an error inserts no rows.
+ */
+
+static int Mysqltcl_Insert(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqlTclHandle *handle;
+  Tcl_DString sql, row, suffix;
+  Tcl_Obj **colObjv, **rowObjv, **valObjv, *duplicateObj = NULL, *resList;
+  int i, r, c, optIdx, colCount, rowCount, valCount, utf8, prefixLen, rowsInStmt = 0, ignore = 0;
+  int stmtCount = 0, transaction = 0;
+  unsigned long maxLen;
+  Tcl_WideInt affected = 0, firstId = 0;
+
+  static CONST char* insertOptions[] = {"-ignore", "-onduplicate", NULL};
+  enum insertoption {INSERT_IGNORE, INSERT_ONDUPLICATE};
+
+  if ((handle = mysql_prologue(interp, objc, objv, 5, 8, CL_CONN,
+			       "handle table columnList rowList ?-ignore? ?-onduplicate assignments?")) == 0)
+    return TCL_ERROR;
+  for (i = 5; i < objc; i++) {
+    if (Tcl_GetIndexFromObj(interp, objv[i], insertOptions, "option",
+			    TCL_EXACT, &optIdx) != TCL_OK)
+      return TCL_ERROR;
+    switch (optIdx) {
+    case INSERT_IGNORE:
+      ignore = 1;
+      break;
+    case INSERT_ONDUPLICATE:
+      if (i+1 >= objc)
+	return mysql_prim_confl(interp,objc,objv,"option -onduplicate needs value") ;
+      duplicateObj = objv[++i];
+      break;
+    }
+  }
+  if (Tcl_ListObjGetElements(interp, objv[3], &colCount, &colObjv) != TCL_OK ||
+      Tcl_ListObjGetElements(interp, objv[4], &rowCount, &rowObjv) != TCL_OK)
+    return TCL_ERROR;
+  if (colCount == 0)
+    return mysql_prim_confl(interp,objc,objv,"column list is empty") ;
+
+  freeResult(handle);
+  if ((maxLen = getMaxAllowedPacket(handle)) == 0)
+    return mysql_server_confl(interp,objc,objv,handle->connection,handle);
+  /* place for packet header */
+  maxLen = (maxLen > 1024) ? maxLen-64 : maxLen;
+  utf8 = isUtf8Handle(handle);
+
+  Tcl_DStringInit(&sql);
+  Tcl_DStringInit(&row);
+  Tcl_DStringInit(&suffix);
+  Tcl_DStringAppend(&sql, ignore ? "INSERT IGNORE INTO " : "INSERT INTO ", -1);
+  appendSqlIdent(handle,&sql,objv[2],1);
+  Tcl_DStringAppend(&sql," (",2);
+  for (c = 0; c < colCount; c++) {
+    if (c > 0) Tcl_DStringAppend(&sql,",",1);
+    appendSqlIdent(handle,&sql,colObjv[c],0);
+  }
+  Tcl_DStringAppend(&sql,") VALUES ",-1);
+  prefixLen = Tcl_DStringLength(&sql);
+  if (duplicateObj != NULL) {
+    Tcl_DStringAppend(&suffix," ON DUPLICATE KEY UPDATE ",-1);
+    appendSqlText(handle,&suffix,duplicateObj);
+  }
+
+  for (r = 0; r <= rowCount; r++) {
+    if (r < rowCount) {
+      if (Tcl_ListObjGetElements(interp, rowObjv[r], &valCount, &valObjv) != TCL_OK)
+	goto error;
+      if (valCount != colCount) {
+	mysql_prim_confl(interp,objc,objv,"number of values does not match columns") ;
+	goto error;
+      }
+      Tcl_DStringSetLength(&row,0);
+      Tcl_DStringAppend(&row,"(",1);
+      for (c = 0; c < colCount; c++) {
+	if (c > 0) Tcl_DStringAppend(&row,",",1);
+	appendSqlValue(handle,&row,valObjv[c],utf8);
+      }
+      Tcl_DStringAppend(&row,")",1);
+    }
+    /* send statement if it is full or all rows are done */
+    if (rowsInStmt > 0 && (r == rowCount ||
+	(unsigned long)(Tcl_DStringLength(&sql)+1+Tcl_DStringLength(&row)+Tcl_DStringLength(&suffix)) > maxLen)) {
+      Tcl_DStringAppend(&sql,Tcl_DStringValue(&suffix),Tcl_DStringLength(&suffix));
+      /* more statements follow: all are sent in one transaction if there is none */
+      if (r < rowCount && stmtCount == 0 &&
+	  (handle->connection->server_status & SERVER_STATUS_AUTOCOMMIT) &&
+	  !(handle->connection->server_status & SERVER_STATUS_IN_TRANS)) {
+	if (mysql_autocommit(handle->connection, 0)) {
+	  mysql_server_confl(interp,objc,objv,handle->connection,handle);
+	  goto error;
+	}
+	transaction = 1;
+      }
+      if (mysql_sendQuery(handle,Tcl_DStringValue(&sql),Tcl_DStringLength(&sql),0)) {
+	mysql_server_confl(interp,objc,objv,handle->connection,handle);
+	goto error;
+      }
+      stmtCount++;
+      affected += (Tcl_WideInt)mysql_affected_rows(handle->connection);
+      if (firstId == 0)
+	firstId = (Tcl_WideInt)mysql_insert_id(handle->connection);
+      Tcl_DStringSetLength(&sql,prefixLen);
+      rowsInStmt = 0;
+    }
+    if (r < rowCount) {
+      if (rowsInStmt > 0) Tcl_DStringAppend(&sql,",",1);
+      Tcl_DStringAppend(&sql,Tcl_DStringValue(&row),Tcl_DStringLength(&row));
+      rowsInStmt++;
+    }
+  }
+  Tcl_DStringFree(&sql);
+  Tcl_DStringFree(&row);
+  Tcl_DStringFree(&suffix);
+  if (transaction) {
+    if (mysql_commit(handle->connection)) {
+      mysql_server_confl(interp,objc,objv,handle->connection,handle);
+      mysql_rollback(handle->connection);
+      mysql_autocommit(handle->connection, 1);
+      return TCL_ERROR;
+    }
+    mysql_autocommit(handle->connection, 1);
+  }
+
+  resList = Tcl_GetObjResult(interp);
+  Tcl_ListObjAppendElement(interp, resList, Tcl_NewWideIntObj(affected));
+  Tcl_ListObjAppendElement(interp, resList, Tcl_NewWideIntObj(firstId));
+  return TCL_OK;
+error:
+  Tcl_DStringFree(&sql);
+  Tcl_DStringFree(&row);
+  Tcl_DStringFree(&suffix);
+  if (transaction) {
+    mysql_rollback(handle->connection);
+    mysql_autocommit(handle->connection, 1);
+  }
+  return TCL_ERROR;
+}
+
+
+
+#if (MYSQL_VERSION_ID >= 40102)
+/*
+ * State of mysql::load while the client library reads the local file.
+ * The rows come from Tcl list rowObjv or from channel; both are
+ * converted into data before they are sent.
+ */
+typedef struct MysqlLoad {
+  MysqlTclHandle *handle;
+  Tcl_Channel channel;           /* source channel (-channel); NULL for row list */
+  Tcl_Obj **rowObjv;             /* rows to load */
+  int rowCount;                  /* number of rows in rowObjv */
+  int row;                       /* next row to format */
+  int colCount;                  /* number of values in every row; -1 until first row */
+  int utf8;                      /* connection encoding is utf-8 */
+  Tcl_DString data;              /* formatted rows or channel data not sent yet */
+  int dataPos;                   /* sent bytes of data */
+  char error[MYSQL_SMALL_SIZE];  /* error message for local_infile_error */
+} MysqlLoad;
+
+/* default format of LOAD DATA: tab separated fields, backslash escapes */
+#define MYSQL_LOAD_NULL "\\N"
+
+/*
+ * Append value as field of LOAD DATA in connection encoding.
+ * Tab, newline, carriage return, NUL and backslash are escaped.
+ */
+static void appendLoadValue(MysqlLoad *load,Tcl_DString *ds,Tcl_Obj *obj)
+{
+  MysqlTclHandle *handle = load->handle;
+  Tcl_DString conv;
+  unsigned char *str;
+  int len, i, start;
+  char esc[2];
+
+  if (obj->typePtr == &mysqlNullType) {
+    Tcl_DStringAppend(ds,MYSQL_LOAD_NULL,2);
+    return;
+  }
+  Tcl_DStringInit(&conv);
+  if (handle->encoding == NULL || (obj->bytes == NULL && obj->typePtr == byteArrayType)) {
+    str = Tcl_GetByteArrayFromObj(obj,&len);
+  } else {
+    str = (unsigned char *)Tcl_GetStringFromObj(obj,&len);
+    if (!load->utf8 || !isTclUtf(str,len)) {
+      str = (unsigned char *)Tcl_UtfToExternalDString(handle->encoding,(char *)str,len,&conv);
+      len = Tcl_DStringLength(&conv);
+    }
+  }
+  esc[0] = '\\';
+  for (start = 0, i = 0; i < len; i++) {
+    switch (str[i]) {
+    case '\t': esc[1] = 't'; break;
+    case '\n': esc[1] = 'n'; break;
+    case '\r': esc[1] = 'r'; break;
+    case '\0': esc[1] = '0'; break;
+    case '\\': esc[1] = '\\'; break;
+    default: continue;
+    }
+    Tcl_DStringAppend(ds,(char *)str+start,i-start);
+    Tcl_DStringAppend(ds,esc,2);
+    start = i+1;
+  }
+  Tcl_DStringAppend(ds,(char *)str+start,len-start);
+  Tcl_DStringFree(&conv);
+}
+
+/*
+ * Format next rows of load->rowObjv until there are at least size bytes.
+ * Returns 0 on error (load->error is set).
+ */
+static int formatLoadRows(MysqlLoad *load,unsigned int size)
+{
+  Tcl_Obj **valObjv;
+  int c, valCount;
+
+  while (load->row < load->rowCount && (unsigned int)Tcl_DStringLength(&load->data) < size) {
+    if (Tcl_ListObjGetElements(NULL, load->rowObjv[load->row], &valCount, &valObjv) != TCL_OK) {
+      sprintf(load->error, "row %d is not a list", load->row);
+      return 0;
+    }
+    if (load->colCount < 0) {
+      load->colCount = valCount;
+    } else if (valCount != load->colCount) {
+      sprintf(load->error, "number of values in row %d does not match", load->row);
+      return 0;
+    }
+    for (c = 0; c < valCount; c++) {
+      if (c > 0) Tcl_DStringAppend(&load->data,"\t",1);
+      appendLoadValue(load,&load->data,valObjv[c]);
+    }
+    Tcl_DStringAppend(&load->data,"\n",1);
+    load->row++;
+  }
+  return 1;
+}
+
+/*
+ * Read next characters of load->channel into load->data in connection
+ * encoding. Tcl_Read would give the text in Tcl's utf-8, not in the
+ * character set named in LOAD DATA. Data of a binary channel is sent
+ * unchanged. Returns 0 on error (load->error is set).
+ */
+static int readLoadChannel(MysqlLoad *load,unsigned int size)
+{
+  MysqlTclHandle *handle = load->handle;
+  Tcl_DString conv;
+  Tcl_Obj *obj;
+  char *str;
+  int len, result = 1;
+
+  obj = Tcl_NewObj();
+  Tcl_IncrRefCount(obj);
+  if (Tcl_ReadChars(load->channel, obj, (int)size, 0) < 0) {
+    sprintf(load->error, "error reading channel: %.100s", Tcl_ErrnoMsg(Tcl_GetErrno()));
+    result = 0;
+  } else if (handle->encoding == NULL || (obj->bytes == NULL && obj->typePtr == byteArrayType)) {
+    str = (char *)Tcl_GetByteArrayFromObj(obj,&len);
+    Tcl_DStringAppend(&load->data,str,len);
+  } else {
+    str = Tcl_GetStringFromObj(obj,&len);
+    if (load->utf8 && isTclUtf((unsigned char *)str,len)) {
+      Tcl_DStringAppend(&load->data,str,len);
+    } else {
+      Tcl_UtfToExternalDString(handle->encoding,str,len,&conv);
+      Tcl_DStringAppend(&load->data,Tcl_DStringValue(&conv),Tcl_DStringLength(&conv));
+      Tcl_DStringFree(&conv);
+    }
+  }
+  Tcl_DecrRefCount(obj);
+  return result;
+}
+
+/*
+ * Callbacks for mysql_set_local_infile_handler.
+ * The client library calls loadRead until it returns 0 (end of data)
+ * or -1 (error, the message is taken from loadError).
+ */
+static int loadInit(void **ptr, const char *filename, void *userdata)
+{
+  *ptr = userdata;
+  return 0;
+}
+
+static int loadRead(void *ptr, char *buf, unsigned int buf_len)
+{
+  MysqlLoad *load = (MysqlLoad *)ptr;
+  int len;
+
+  if (load->dataPos >= Tcl_DStringLength(&load->data)) {
+    Tcl_DStringSetLength(&load->data,0);
+    load->dataPos = 0;
+    if (load->channel != NULL ? !readLoadChannel(load,buf_len) : !formatLoadRows(load,buf_len))
+      return -1;
+  }
+  len = Tcl_DStringLength(&load->data)-load->dataPos;
+  if ((unsigned int)len > buf_len) len = (int)buf_len;
+  memcpy(buf,Tcl_DStringValue(&load->data)+load->dataPos,len);
+  load->dataPos += len;
+  return len;
+}
+
+static void loadEnd(void *ptr)
+{
+}
+
+static int loadError(void *ptr, char *error_msg, unsigned int error_msg_len)
+{
+  MysqlLoad *load = (MysqlLoad *)ptr;
+
+  strncpy(error_msg, load->error[0] ? load->error : "mysql::load failed", error_msg_len-1);
+  error_msg[error_msg_len-1] = '\0';
+  return 2000; /* CR_UNKNOWN_ERROR */
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Load
+ *    Implements the mysql::load command:
+ *    usage: mysql::load handle table rowList|-channel chan ?-columns list? ?-replace|-ignore?
+ *
+ *    results:
+ *	number of loaded rows.
+ *	The rows are sent with LOAD DATA LOCAL INFILE; the client library
+ *	reads them from the Tcl list or channel, no file is written.
+ */
+
+static int Mysqltcl_Load(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqlTclHandle *handle;
+  MysqlLoad load;
+  Tcl_DString sql;
+  Tcl_Obj *rowsObj = NULL, *colsObj = NULL, **colObjv;
+  CONST char *charset;
+  int i, c, optIdx, colCount, mode, result;
+  Tcl_WideInt affected;
+
+  static CONST char* loadOptions[] = {"-channel", "-columns", "-replace", "-ignore", NULL};
+  enum loadoption {LOAD_CHANNEL, LOAD_COLUMNS, LOAD_REPLACE, LOAD_IGNORE};
+
+  if ((handle = mysql_prologue(interp, objc, objv, 4, 8, CL_CONN,
+			       "handle table rowList|-channel chan ?-columns list? ?-replace|-ignore?")) == 0)
+    return TCL_ERROR;
+
+  memset(&load, 0, sizeof(load));
+  load.handle = handle;
+  load.colCount = -1;
+  mode = -1;
+  for (i = 3; i < objc; i++) {
+    if (i == 3 && strcmp(Tcl_GetString(objv[i]),"-channel") != 0) {
+      rowsObj = objv[i];
+      continue;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[i], loadOptions, "option",
+			    TCL_EXACT, &optIdx) != TCL_OK)
+      return TCL_ERROR;
+    switch (optIdx) {
+    case LOAD_CHANNEL:
+      if (i+1 >= objc)
+	return mysql_prim_confl(interp,objc,objv,"option -channel needs value") ;
+      if ((load.channel = Tcl_GetChannel(interp, Tcl_GetString(objv[++i]), &c)) == NULL)
+	return TCL_ERROR;
+      if (!(c & TCL_READABLE))
+	return mysql_prim_confl(interp,objc,objv,"channel is not readable") ;
+      break;
+    case LOAD_COLUMNS:
+      if (i+1 >= objc)
+	return mysql_prim_confl(interp,objc,objv,"option -columns needs value") ;
+      colsObj = objv[++i];
+      break;
+    case LOAD_REPLACE:
+    case LOAD_IGNORE:
+      mode = optIdx;
+      break;
+    }
+  }
+  if ((rowsObj == NULL) == (load.channel == NULL))
+    return mysql_prim_confl(interp,objc,objv,"either rowList or -channel is required") ;
+  if (rowsObj != NULL &&
+      Tcl_ListObjGetElements(interp, rowsObj, &load.rowCount, &load.rowObjv) != TCL_OK)
+    return TCL_ERROR;
+  colCount = 0;
+  if (colsObj != NULL &&
+      Tcl_ListObjGetElements(interp, colsObj, &colCount, &colObjv) != TCL_OK)
+    return TCL_ERROR;
+
+  freeResult(handle);
+  load.utf8 = isUtf8Handle(handle);
+  if (colCount > 0) load.colCount = colCount;
+
+  Tcl_DStringInit(&sql);
+  Tcl_DStringAppend(&sql, "LOAD DATA LOCAL INFILE 'mysqltcl' ", -1);
+  if (mode == LOAD_REPLACE) {
+    Tcl_DStringAppend(&sql, "REPLACE ", -1);
+  } else if (mode == LOAD_IGNORE) {
+    Tcl_DStringAppend(&sql, "IGNORE ", -1);
+  }
+  Tcl_DStringAppend(&sql, "INTO TABLE ", -1);
+  appendSqlIdent(handle,&sql,objv[2],1);
+  /* the file is read in character set of connection, not of database */
+  charset = (handle->encoding == NULL) ? "binary" : mysql_character_set_name(handle->connection);
+  Tcl_DStringAppend(&sql, " CHARACTER SET ", -1);
+  Tcl_DStringAppend(&sql, charset, -1);
+  if (colCount > 0) {
+    Tcl_DStringAppend(&sql," (",2);
+    for (c = 0; c < colCount; c++) {
+      if (c > 0) Tcl_DStringAppend(&sql,",",1);
+      appendSqlIdent(handle,&sql,colObjv[c],0);
+    }
+    Tcl_DStringAppend(&sql,")",1);
+  }
+
+  /* the row list must not change while the client library reads it */
+  if (rowsObj != NULL) Tcl_IncrRefCount(rowsObj);
+  Tcl_DStringInit(&load.data);
+  mysql_set_local_infile_handler(handle->connection, loadInit, loadRead, loadEnd, loadError, &load);
+  result = mysql_sendQuery(handle,Tcl_DStringValue(&sql),Tcl_DStringLength(&sql),0);
+  mysql_set_local_infile_default(handle->connection);
+  Tcl_DStringFree(&load.data);
+  Tcl_DStringFree(&sql);
+  if (rowsObj != NULL) Tcl_DecrRefCount(rowsObj);
+
+  if (result)
+    return mysql_server_confl(interp,objc,objv,handle->connection,handle);
+  affected = (Tcl_WideInt)mysql_affected_rows(handle->connection);
+  Tcl_SetObjResult(interp, Tcl_NewWideIntObj(affected));
+  return TCL_OK;
+}
+#endif
+
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Fetch
+ *    Implements the mysqlnext command:
+
+ *    usage: mysql::fetch handle ?-count n? ?-flatlist|-dicts?
+ *	                
+ *    results:
+ *	next row from pending results as tcl list (or dict), or null list.
+ *	With -count up to n rows are returned as list of rows in one call
+ *	(or as one flat list with -flatlist).
+ */
+
+static int Mysqltcl_Fetch(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData; 
+  MysqlTclHandle *handle;
   MYSQL_ROW row ;
   Tcl_Obj *resList;
   unsigned long *lengths;
+  int i, optIdx, rowIdx, resLen, count = 0, flat = 0, dicts = 0;
 
-  if ((handle = mysql_prologue(interp, objc, objv, 2, 2, CL_RES,"handle")) == 0)
+  static CONST char* fetchOptions[] = {"-count", "-flatlist", "-dicts", NULL};
+  enum fetchoption {FETCH_COUNT, FETCH_FLATLIST, FETCH_DICTS};
+
+  if ((handle = mysql_prologue(interp, objc, objv, 2, 5, CL_RES,"handle ?-count n? ?-flatlist|-dicts?")) == 0)
     return TCL_ERROR;
 
+  for (i = 2; i < objc; i++) {
+    if (Tcl_GetIndexFromObj(interp, objv[i], fetchOptions, "option",
+			    TCL_EXACT, &optIdx) != TCL_OK)
+      return TCL_ERROR;
+    switch (optIdx) {
+    case FETCH_COUNT:
+      if (i+1 >= objc)
+	return mysql_prim_confl(interp,objc,objv,"option -count needs value") ;
+      if (Tcl_GetIntFromObj(interp, objv[++i], &count) != TCL_OK)
+	return TCL_ERROR;
+      if (count <= 0)
+	return mysql_prim_confl(interp,objc,objv,"row count must be positive") ;
+      break;
+    case FETCH_FLATLIST:
+      flat = 1;
+      break;
+    case FETCH_DICTS:
+      dicts = 1;
+      break;
+    }
+  }
+  if (flat && count == 0)
+    return mysql_prim_confl(interp,objc,objv,"option -flatlist needs -count") ;
+  if (flat && dicts)
+    return mysql_prim_confl(interp,objc,objv,"options -flatlist and -dicts exclude each other") ;
 
-  if (handle->res_count == 0)
-    return TCL_OK ;
-  else if ((row = mysql_fetch_row(handle->result)) == NULL) {
-    handle->res_count = 0 ;
-    return mysql_prim_confl(interp,objc,objv,"result counter out of sync") ;
-  } else
-    handle->res_count-- ;
+  if (count == 0) {
+    if (handle->res_count == 0)
+      return TCL_OK ;
+    else if ((row = mysql_fetch_row(handle->result)) == NULL) {
+      handle->res_count = 0 ;
+      return mysql_prim_confl(interp,objc,objv,"result counter out of sync") ;
+    } else
+      handle->res_count-- ;
   
-  lengths = mysql_fetch_lengths(handle->result);
+    lengths = mysql_fetch_lengths(handle->result);
+
+    if (dicts) {
+      Tcl_SetObjResult(interp, getRowAsDict(statePtr,handle,row,lengths));
+      return TCL_OK;
+    }
 
+    Tcl_SetObjResult(interp, getRowAsList(statePtr,handle,row,lengths));
+    return TCL_OK;
+  }
 
+  /* Batched form: up to count rows in one command invocation */
   resList = Tcl_GetObjResult(interp);
-  for (idx = 0 ; idx < handle->col_count ; idx++, row++) {
-    Tcl_ListObjAppendElement(interp, resList,getRowCellAsObject(statePtr,handle,row,lengths[idx]));
+  resLen = 0;
+  for (rowIdx = 0; rowIdx < count && handle->res_count > 0; rowIdx++) {
+    if ((row = mysql_fetch_row(handle->result)) == NULL) {
+      handle->res_count = 0 ;
+      return mysql_prim_confl(interp,objc,objv,"result counter out of sync") ;
+    }
+    handle->res_count-- ;
+    lengths = mysql_fetch_lengths(handle->result);
+    if (dicts) {
+      Tcl_ListObjAppendElement(interp, resList, getRowAsDict(statePtr,handle,row,lengths));
+      continue;
+    }
+    if (flat) {
+      Tcl_ListObjReplace(interp, resList, resLen, 0, handle->col_count, getRowObjv(statePtr,handle,row,lengths));
+      resLen += handle->col_count;
+    } else {
+      Tcl_ListObjAppendElement(interp, resList, getRowAsList(statePtr,handle,row,lengths));
+    }
   }
   return TCL_OK;
 }
@@ -1319,83 +4105,52 @@ static int Mysqltcl_Map(ClientData clientData, Tcl_Interp *interp, int objc, Tcl
 {
   MysqltclState *statePtr = (MysqltclState *)clientData; 
   int code ;
-  int count ;
 
   MysqlTclHandle *handle;
-  int idx;
   int listObjc;
-  Tcl_Obj *tempObj,*varNameObj;
+  Tcl_Obj **listObjv;
   MYSQL_ROW row;
-  int *val;
-  unsigned long *lengths;
+  MysqlVarBinding binding;
   
   if ((handle = mysql_prologue(interp, objc, objv, 4, 4, CL_RES,
 			    "handle binding-list script")) == 0)
     return TCL_ERROR;
 
-  if (Tcl_ListObjLength(interp, objv[2], &listObjc) != TCL_OK)
+  if (Tcl_ListObjGetElements(interp, objv[2], &listObjc, &listObjv) != TCL_OK)
         return TCL_ERROR ;
   
-
   if (listObjc > handle->col_count)
     {
       return mysql_prim_confl(interp,objc,objv,"too many variables in binding list") ;
     }
-  else
-    count = (listObjc < handle->col_count)?listObjc
-      :handle->col_count ;
-  
-  val=(int*)Tcl_Alloc((count * sizeof(int)));
-
-  for (idx=0; idx<count; idx++) {
-    val[idx]=1;
-    if (Tcl_ListObjIndex(interp, objv[2], idx, &varNameObj)!=TCL_OK)
-        return TCL_ERROR;
-    if (Tcl_GetStringFromObj(varNameObj,0)[0] != '-')
-        val[idx]=1;
-    else
-        val[idx]=0;
-  }
+  initVarBinding(&binding, listObjc, listObjv);
   
-  while (handle->res_count > 0) {
+  /* the script may close the handle */
+  Tcl_Preserve((ClientData)handle);
+  code = TCL_OK;
+  while (handle->res_count > 0 && handle->result != NULL) {
     /* Get next row, decrement row counter. */
     if ((row = mysql_fetch_row(handle->result)) == NULL) {
       handle->res_count = 0 ;
-      Tcl_Free((char *)val);
-      return mysql_prim_confl(interp,objc,objv,"result counter out of sync") ;
+      code = mysql_prim_confl(interp,objc,objv,"result counter out of sync") ;
+      break;
     } else
       handle->res_count-- ;
       
     /* Bind variables to column values. */
-    for (idx = 0; idx < count; idx++, row++) {
-      lengths = mysql_fetch_lengths(handle->result);
-      if (val[idx]) {
-	tempObj = getRowCellAsObject(statePtr,handle,row,lengths[idx]);
-        if (Tcl_ListObjIndex(interp, objv[2], idx, &varNameObj) != TCL_OK)
-            goto error;
-	if (Tcl_ObjSetVar2 (interp,varNameObj,NULL,tempObj,0) == NULL)
-            goto error;
-      }
+    if (setBoundVars(statePtr,interp,handle,&binding,row,mysql_fetch_lengths(handle->result)) != TCL_OK) {
+      code = TCL_ERROR;
+      break;
     }
 
     /* Evaluate the script. */
-    switch(code=Tcl_EvalObjEx(interp, objv[3],0)) {
-    case TCL_CONTINUE:
-    case TCL_OK:
-      break ;
-    case TCL_BREAK:
-      Tcl_Free((char *)val);
-      return TCL_OK ;
-    default:
-      Tcl_Free((char *)val);
-      return code ;
-    }
+    code = Tcl_EvalObjEx(interp, objv[3],0);
+    if (code == TCL_CONTINUE) code = TCL_OK;
+    if (code != TCL_OK) break;
   }
-  Tcl_Free((char *)val);
-  return TCL_OK ;
-error:
-  Tcl_Free((char *)val);
-  return TCL_ERROR;    
+  freeVarBinding(&binding);
+  Tcl_Release((ClientData)handle);
+  return (code == TCL_BREAK) ? TCL_OK : code;
 }
 
 /*
@@ -1404,6 +4159,8 @@ error:
  * Mysqltcl_Receive
  * Implements the mysqlmap command:
  * usage: mysqlmap handle sqlquery binding-list script
+ *        mysqlmap handle sqlquery -dicts varName script
+ *        mysqlmap handle sqlquery -batch n -command cmdPrefix
  * 
  * The method use internal mysql_use_result that no cache statment on client but
  * receive it direct from server 
@@ -1411,104 +4168,173 @@ error:
  * Results:
  * SIDE EFFECT: For each row the column values are bound to the variables
  * in the binding list and the script is evaluated.
+ * With -dicts the whole row is bound as dict to one variable.
+ * With -batch up to n rows are collected in one list that is appended to
+ * cmdPrefix, so the command is called once per batch.
  * The variables are created in the current context.
  * NOTE: mysqlmap works very much like a 'foreach' construct.
  * The 'continue' and 'break' commands may be used with their usual effect.
 
  */
 
+/*
+ * Receive rows of current result in batches (mysql::receive -batch).
+ * Returns the code of last command call.
+ */
+static int receiveBatches(MysqltclState *statePtr,Tcl_Interp *interp,MysqlTclHandle *handle,int batchSize,Tcl_Obj *cmdPrefix)
+{
+  Tcl_Obj **prefixObjv, **cmdObjv;
+  Tcl_Obj *batch;
+  MYSQL_ROW row;
+  int prefixObjc, i, rowCount, code = TCL_OK, last = 0;
+
+  if (Tcl_ListObjGetElements(interp, cmdPrefix, &prefixObjc, &prefixObjv) != TCL_OK)
+    return TCL_ERROR;
+  /* command words are copied, the prefix list may change by the command */
+  cmdObjv = (Tcl_Obj **)Tcl_Alloc(sizeof(Tcl_Obj *)*(prefixObjc+1));
+  for (i = 0; i < prefixObjc; i++) {
+    cmdObjv[i] = prefixObjv[i];
+    Tcl_IncrRefCount(cmdObjv[i]);
+  }
+
+  handle->col_count = mysql_num_fields(handle->result);
+  while (!last) {
+    /* the list grows with the rows, batchSize may be far above the row count */
+    batch = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(batch);
+    rowCount = 0;
+    while (rowCount < batchSize && (row = mysql_fetch_row(handle->result)) != NULL) {
+      Tcl_ListObjAppendElement(NULL, batch, getRowAsList(statePtr,handle,row,mysql_fetch_lengths(handle->result)));
+      rowCount++;
+    }
+    if (rowCount < batchSize) {
+      last = 1;
+      if (rowCount == 0) {
+	Tcl_DecrRefCount(batch);
+	break;
+      }
+    }
+    /* no call for rest of broken result */
+    if (!last || !mysql_errno(handle->connection)) {
+      cmdObjv[prefixObjc] = batch;
+      code = Tcl_EvalObjv(interp, prefixObjc+1, cmdObjv, 0);
+    }
+    Tcl_DecrRefCount(batch);
+    if ((code!=TCL_OK && code!=TCL_CONTINUE) || handle->result == NULL) break;
+  }
+
+  for (i = 0; i < prefixObjc; i++) {
+    Tcl_DecrRefCount(cmdObjv[i]);
+  }
+  Tcl_Free((char *)cmdObjv);
+  return code;
+}
+
 static int Mysqltcl_Receive(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
   MysqltclState *statePtr = (MysqltclState *)clientData; 
   int code=0;
-  int count=0;
 
   MysqlTclHandle *handle;
-  int idx;
   int listObjc;
-  Tcl_Obj *tempObj,*varNameObj;
+  Tcl_Obj **listObjv;
+  Tcl_Obj *varNameObj,*scriptObj;
   MYSQL_ROW row;
-  int *val = NULL;
-  int breakLoop = 0;
+  MysqlVarBinding binding;
+  int dicts = 0;
+  int batchSize = 0;
+  Tcl_Obj *cmdPrefix = NULL;
   unsigned long *lengths;
+  int i, optIdx;
+
+  static CONST char* batchOptions[] = {"-batch", "-command", NULL};
+  enum batchoption {RECEIVE_BATCH, RECEIVE_COMMAND};
   
-  
-  if ((handle = mysql_prologue(interp, objc, objv, 5, 5, CL_CONN,
-			    "handle sqlquery binding-list script")) == 0)
+  if ((handle = mysql_prologue(interp, objc, objv, 5, 7, CL_CONN,
+			    "handle sqlquery binding-list|-dicts varName script | handle sqlquery -batch n -command cmdPrefix")) == 0)
     return TCL_ERROR;
-  
-  if (Tcl_ListObjLength(interp, objv[3], &listObjc) != TCL_OK)
+
+  if (objc==7) {
+    for (i = 3; i < objc; i += 2) {
+      if (Tcl_GetIndexFromObj(interp, objv[i], batchOptions, "option",
+			      TCL_EXACT, &optIdx) != TCL_OK)
+	return TCL_ERROR;
+      if (optIdx==RECEIVE_BATCH) {
+	if (Tcl_GetIntFromObj(interp, objv[i+1], &batchSize) != TCL_OK)
+	  return TCL_ERROR;
+	if (batchSize <= 0)
+	  return mysql_prim_confl(interp,objc,objv,"batch size must be positive");
+      } else {
+	cmdPrefix = objv[i+1];
+      }
+    }
+    if (batchSize==0 || cmdPrefix==NULL)
+      return mysql_prim_confl(interp,objc,objv,"usage: handle sqlquery -batch n -command cmdPrefix");
+  } else if (objc==6) {
+    if (strcmp(Tcl_GetStringFromObj(objv[3],NULL), "-dicts"))
+      return mysql_prim_confl(interp,objc,objv,"usage: handle sqlquery -dicts varName script");
+    dicts = 1;
+    varNameObj = objv[4];
+    scriptObj = objv[5];
+  } else {
+    if (Tcl_ListObjGetElements(interp, objv[3], &listObjc, &listObjv) != TCL_OK)
         return TCL_ERROR;
+    scriptObj = objv[4];
+  }
   
   freeResult(handle);
   
   if (mysql_QueryTclObj(handle,objv[2])) {
-    return mysql_server_confl(interp,objc,objv,handle->connection);
+    return mysql_server_confl(interp,objc,objv,handle->connection,handle);
   }
 
   if ((handle->result = mysql_use_result(handle->connection)) == NULL) {
-    return mysql_server_confl(interp,objc,objv,handle->connection);
-  } else {
+    return mysql_server_confl(interp,objc,objv,handle->connection,handle);
+  }
+  /* the script may close the handle */
+  Tcl_Preserve((ClientData)handle);
+  if (batchSize>0) {
+    code = receiveBatches(statePtr,interp,handle,batchSize,cmdPrefix);
+  } else if (dicts) {
+    handle->col_count = mysql_num_fields(handle->result);
     while ((row = mysql_fetch_row(handle->result))!= NULL) {
-      if (val==NULL) {
-	/* first row compute all data */
-	handle->col_count = mysql_num_fields(handle->result);
-	if (listObjc > handle->col_count) {
-          return mysql_prim_confl(interp,objc,objv,"too many variables in binding list") ;
-	} else {
-	  count = (listObjc < handle->col_count)?listObjc:handle->col_count ;
-	}
-	val=(int*)Tcl_Alloc((count * sizeof(int)));
-	for (idx=0; idx<count; idx++) {
-          if (Tcl_ListObjIndex(interp, objv[3], idx, &varNameObj)!=TCL_OK)
-            return TCL_ERROR;
-	  if (Tcl_GetStringFromObj(varNameObj,0)[0] != '-')
-	    val[idx]=1;
-	  else
-	    val[idx]=0;
-	}	
-      }
-      for (idx = 0; idx < count; idx++, row++) {
-	 lengths = mysql_fetch_lengths(handle->result);
-
-	 if (val[idx]) {
-	    if (Tcl_ListObjIndex(interp, objv[3], idx, &varNameObj)!=TCL_OK) {
-                Tcl_Free((char *)val);
-                return TCL_ERROR;
-            }
-            tempObj = getRowCellAsObject(statePtr,handle,row,lengths[idx]);
-            if (Tcl_ObjSetVar2 (interp,varNameObj,NULL,tempObj,TCL_LEAVE_ERR_MSG) == NULL) {
-	       Tcl_Free((char *)val);
-	       return TCL_ERROR ;
-	    }
-	 }
+      lengths = mysql_fetch_lengths(handle->result);
+      if (Tcl_ObjSetVar2(interp,varNameObj,NULL,getRowAsDict(statePtr,handle,row,lengths),TCL_LEAVE_ERR_MSG) == NULL) {
+        code = TCL_ERROR;
+        break;
       }
-      
-      /* Evaluate the script. */
-      switch(code=Tcl_EvalObjEx(interp, objv[4],0)) {
-      case TCL_CONTINUE:
-      case TCL_OK:
-	break ;
-      case TCL_BREAK:
-	breakLoop=1;
-	break;
-      default:
-	breakLoop=1;
-	break;
+      code = Tcl_EvalObjEx(interp, scriptObj, 0);
+      if ((code!=TCL_OK && code!=TCL_CONTINUE) || handle->result == NULL) break;
+    }
+  } else {
+    handle->col_count = mysql_num_fields(handle->result);
+    if (listObjc > handle->col_count) {
+      code = mysql_prim_confl(interp,objc,objv,"too many variables in binding list") ;
+    } else {
+      /* the binding list is resolved once, not for every row */
+      initVarBinding(&binding, listObjc, listObjv);
+      while ((row = mysql_fetch_row(handle->result))!= NULL) {
+	if (setBoundVars(statePtr,interp,handle,&binding,row,mysql_fetch_lengths(handle->result)) != TCL_OK) {
+	  code = TCL_ERROR;
+	  break;
+	}
+	/* Evaluate the script. */
+	code = Tcl_EvalObjEx(interp, scriptObj,0);
+	if ((code!=TCL_OK && code!=TCL_CONTINUE) || handle->result == NULL) break;
       }
-      if (breakLoop==1) break;
+      freeVarBinding(&binding);
     }
   }
-  if (val!=NULL) {
-    Tcl_Free((char *)val);
-  } 
-  /*  Read all rest rows that leave in error or break case */
-  while ((row = mysql_fetch_row(handle->result))!= NULL);
-  if (code!=TCL_CONTINUE && code!=TCL_OK && code!=TCL_BREAK) {
-    return code;
-  } else {
-    return mysql_server_confl(interp,objc,objv,handle->connection);
-  } 
+  /* the result is gone if the script has closed the handle */
+  if (handle->result != NULL) {
+    /*  Read all rest rows that leave in error or break case */
+    while ((row = mysql_fetch_row(handle->result))!= NULL);
+    if (code==TCL_CONTINUE || code==TCL_OK || code==TCL_BREAK) {
+      code = mysql_server_confl(interp,objc,objv,handle->connection,handle);
+    }
+  }
+  Tcl_Release((ClientData)handle);
+  return (code==TCL_CONTINUE || code==TCL_BREAK) ? TCL_OK : code;
 }
 
 
@@ -1536,7 +4362,8 @@ static int Mysqltcl_Info(ClientData clientData, Tcl_Interp *interp, int objc, Tc
   static CONST char* MysqlDbOpt[] =
     {
       "dbname", "dbname?", "tables", "host", "host?", "databases",
-      "info","serverversion",
+      "info","serverversion","encodedbytes","querybuffer",
+      "stmtcachehits","stmtcachemisses",
 #if (MYSQL_VERSION_ID >= 40107)
       "serverversionid","sqlstate",
 #endif
@@ -1545,7 +4372,9 @@ static int Mysqltcl_Info(ClientData clientData, Tcl_Interp *interp, int objc, Tc
   enum dboption {
     MYSQL_INFNAME_OPT, MYSQL_INFNAMEQ_OPT, MYSQL_INFTABLES_OPT,
     MYSQL_INFHOST_OPT, MYSQL_INFHOSTQ_OPT, MYSQL_INFLIST_OPT, MYSQL_INFO,
-    MYSQL_INF_SERVERVERSION,MYSQL_INFO_SERVERVERSION_ID,MYSQL_INFO_SQLSTATE,MYSQL_INFO_STATE
+    MYSQL_INF_SERVERVERSION,MYSQL_INFO_ENCODEDBYTES,MYSQL_INFO_QUERYBUFFER,
+    MYSQL_INFO_STMTCACHEHITS,MYSQL_INFO_STMTCACHEMISSES,
+    MYSQL_INFO_SERVERVERSION_ID,MYSQL_INFO_SQLSTATE,MYSQL_INFO_STATE
   };
   
   /* We can't fully check the handle at this stage. */
@@ -1574,6 +4403,10 @@ static int Mysqltcl_Info(ClientData clientData, Tcl_Interp *interp, int objc, Tc
     break;
   case MYSQL_INFO:
   case MYSQL_INF_SERVERVERSION:
+  case MYSQL_INFO_ENCODEDBYTES:
+  case MYSQL_INFO_QUERYBUFFER:
+  case MYSQL_INFO_STMTCACHEHITS:
+  case MYSQL_INFO_STMTCACHEMISSES:
 #if (MYSQL_VERSION_ID >= 40107)
   case MYSQL_INFO_SERVERVERSION_ID:
   case MYSQL_INFO_SQLSTATE:
@@ -1599,7 +4432,7 @@ static int Mysqltcl_Info(ClientData clientData, Tcl_Interp *interp, int objc, Tc
     break ;
   case MYSQL_INFTABLES_OPT:
     if ((list = mysql_list_tables(handle->connection,(char*)NULL)) == NULL)
-      return mysql_server_confl(interp,objc,objv,handle->connection);
+      return mysql_server_confl(interp,objc,objv,handle->connection,handle);
     
     resList = Tcl_GetObjResult(interp);
     for (count = mysql_num_rows(list); count > 0; count--) {
@@ -1615,7 +4448,7 @@ static int Mysqltcl_Info(ClientData clientData, Tcl_Interp *interp, int objc, Tc
     break ;
   case MYSQL_INFLIST_OPT:
     if ((list = mysql_list_dbs(handle->connection,(char*)NULL)) == NULL)
-      return mysql_server_confl(interp,objc,objv,handle->connection);
+      return mysql_server_confl(interp,objc,objv,handle->connection,handle);
     
     resList = Tcl_GetObjResult(interp);
     for (count = mysql_num_rows(list); count > 0; count--) {
@@ -1634,6 +4467,23 @@ static int Mysqltcl_Info(ClientData clientData, Tcl_Interp *interp, int objc, Tc
   case MYSQL_INF_SERVERVERSION:
      Tcl_SetObjResult(interp, Tcl_NewStringObj(mysql_get_server_info(handle->connection),-1));
      break;
+  case MYSQL_INFO_ENCODEDBYTES:
+     Tcl_SetObjResult(interp, Tcl_NewWideIntObj(handle->encodedBytes));
+     break;
+  case MYSQL_INFO_QUERYBUFFER:
+     Tcl_SetObjResult(interp, Tcl_NewIntObj(handle->queryBufSize));
+     break;
+  case MYSQL_INFO_STMTCACHEHITS:
+  case MYSQL_INFO_STMTCACHEMISSES:
+#ifdef PREPARED_STATEMENT
+     if (handle->stmtCache!=NULL) {
+       Tcl_SetObjResult(interp, Tcl_NewWideIntObj((idx==MYSQL_INFO_STMTCACHEHITS) ?
+						  handle->stmtCache->hits : handle->stmtCache->misses));
+       break;
+     }
+#endif
+     Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+     break;
 #if (MYSQL_VERSION_ID >= 40107)
   case MYSQL_INFO_SERVERVERSION_ID:
 	 Tcl_SetObjResult(interp, Tcl_NewIntObj(mysql_get_server_version(handle->connection)));
@@ -1835,7 +4685,7 @@ static int Mysqltcl_Col(ClientData clientData, Tcl_Interp *interp, int objc, Tcl
       result = handle->result ;
   } else {
     if ((result = mysql_list_fields(handle->connection, argv, (char*)NULL)) == NULL) {
-      return mysql_server_confl(interp,objc,objv,handle->connection) ;
+      return mysql_server_confl(interp,objc,objv,handle->connection,handle) ;
     }
   }
   /* Must examine the first specifier at this point. */
@@ -2005,8 +4855,13 @@ static int Mysqltcl_ChangeUser(ClientData clientData, Tcl_Interp *interp, int ob
        return TCL_ERROR;
     }
   }
+#ifdef PREPARED_STATEMENT
+  /* server closes all prepared statements of session */
+  if (handle->stmtCache!=NULL)
+    flushStmtCache(handle->stmtCache);
+#endif
   if (mysql_change_user(handle->connection, user, password, database)!=0) {
-      mysql_server_confl(interp,objc,objv,handle->connection);
+      mysql_server_confl(interp,objc,objv,handle->connection,handle);
       return TCL_ERROR;
   }
   if (database!=NULL) 
@@ -2036,7 +4891,7 @@ static int Mysqltcl_AutoCommit(ClientData clientData, Tcl_Interp *interp, int ob
   if (Tcl_GetBooleanFromObj(interp,objv[2],&isAutocommit) != TCL_OK )
 	return TCL_ERROR;
   if (mysql_autocommit(handle->connection, isAutocommit)!=0) {
-  	mysql_server_confl(interp,objc,objv,handle->connection);
+  	mysql_server_confl(interp,objc,objv,handle->connection,handle);
   }
   return TCL_OK;
 #endif
@@ -2061,7 +4916,7 @@ static int Mysqltcl_Commit(ClientData clientData, Tcl_Interp *interp, int objc,
 			    "handle")) == 0)
     return TCL_ERROR;
   if (mysql_commit(handle->connection)!=0) {
-  	mysql_server_confl(interp,objc,objv,handle->connection);
+  	mysql_server_confl(interp,objc,objv,handle->connection,handle);
   }
   return TCL_OK;
 #endif
@@ -2086,7 +4941,7 @@ static int Mysqltcl_Rollback(ClientData clientData, Tcl_Interp *interp, int objc
 			    "handle")) == 0)
     return TCL_ERROR;
   if (mysql_rollback(handle->connection)!=0) {
-      mysql_server_confl(interp,objc,objv,handle->connection);
+      mysql_server_confl(interp,objc,objv,handle->connection,handle);
   }
   return TCL_OK;
 #endif
@@ -2138,6 +4993,7 @@ static int Mysqltcl_NextResult(ClientData clientData, Tcl_Interp *interp, int ob
   if ((handle = mysql_prologue(interp, objc, objv, 2, 2, CL_RES,
 			    "handle")) == 0)
     return TCL_ERROR;
+  freeColumnNames(handle);
   if (handle->result != NULL) {
     mysql_free_result(handle->result) ;
     handle->result = NULL ;
@@ -2148,12 +5004,13 @@ static int Mysqltcl_NextResult(ClientData clientData, Tcl_Interp *interp, int ob
       return TCL_OK;
   }
   if (result<0) {
-      return mysql_server_confl(interp,objc,objv,handle->connection);
+      return mysql_server_confl(interp,objc,objv,handle->connection,handle);
   }
-  handle->result = mysql_store_result(handle->connection);
+  handle->result = storeResult(handle);
   if (handle->result == NULL) {
       Tcl_SetObjResult(interp, Tcl_NewIntObj(-1));
   } else {
+      handle->col_count = mysql_num_fields(handle->result);
       handle->res_count = mysql_num_rows(handle->result);
       Tcl_SetObjResult(interp, Tcl_NewIntObj(handle->res_count));
   }
@@ -2207,17 +5064,57 @@ static int Mysqltcl_IsNull(ClientData clientData, Tcl_Interp *interp, int objc,
   return TCL_OK;
 }
 /*
- * Create new Mysql NullObject
+ * Return Mysql NullObject
  * (similar to Tcl API for example Tcl_NewIntObj)
+ * Every NULL value is an own object, so a type change of one value does
+ * not touch the others. The string is the null value at creation; for the
+ * default empty null value it is the shared empty string of Tcl and needs
+ * no allocation.
  */
 static Tcl_Obj *Mysqltcl_NewNullObj(MysqltclState *mysqltclState) {
   Tcl_Obj *objPtr;
+  int valueLen;
+
   objPtr = Tcl_NewObj();
-  objPtr->bytes = NULL;
+  valueLen = strlen(mysqltclState->MysqlNullvalue);
+  if (valueLen > 0) {
+    objPtr->bytes = Tcl_Alloc(valueLen+1);
+    memcpy(objPtr->bytes,mysqltclState->MysqlNullvalue,valueLen+1);
+    objPtr->length = valueLen;
+  }
   objPtr->typePtr = &mysqlNullType;
   objPtr->internalRep.otherValuePtr = mysqltclState;
   return objPtr;
 }
+
+/*
+ * Read trace on mysqlstatus(code) in lazy status mode: the code of
+ * successful commands is written to the array only when it is read
+ */
+static char *Mysqltcl_StatusTrace(ClientData clientData, Tcl_Interp *interp, CONST char *name1, CONST char *name2, int flags)
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData;
+  set_statusArr(interp,MYSQL_STATUS_CODE,Tcl_NewIntObj(statePtr->statusCode));
+  return NULL;
+}
+
+/*
+ * Switch between compatibility (0) and lazy (1) status mode.
+ */
+static void setStatusMode(MysqltclState *statePtr,int lazy)
+{
+  if (lazy == statePtr->statusLazy) return;
+  if (lazy) {
+    statePtr->statusCode = 0;
+    Tcl_TraceVar2(statePtr->interp, MYSQL_STATUS_ARR, MYSQL_STATUS_CODE, TCL_GLOBAL_ONLY|TCL_TRACE_READS,
+		  Mysqltcl_StatusTrace, (ClientData)statePtr);
+  } else {
+    Tcl_UntraceVar2(statePtr->interp, MYSQL_STATUS_ARR, MYSQL_STATUS_CODE, TCL_GLOBAL_ONLY|TCL_TRACE_READS,
+		    Mysqltcl_StatusTrace, (ClientData)statePtr);
+    set_statusArr(statePtr->interp,MYSQL_STATUS_CODE,Tcl_NewIntObj(statePtr->statusCode));
+  }
+  statePtr->statusLazy = lazy;
+}
 /*
  *----------------------------------------------------------------------
  *
@@ -2267,170 +5164,1258 @@ static int Mysqltcl_SetServerOption(ClientData clientData, Tcl_Interp *interp, i
 			    "handle option")) == 0)
     return TCL_ERROR;
 
-  if (Tcl_GetIndexFromObj(interp, objv[2], MysqlServerOpt, "option",
-                          0, &idx) != TCL_OK)
-      return TCL_ERROR;
+  if (Tcl_GetIndexFromObj(interp, objv[2], MysqlServerOpt, "option",
+                          0, &idx) != TCL_OK)
+      return TCL_ERROR;
+
+  switch (idx) {
+    case MYSQL_MSTATMENT_ON_SOPT:
+      mysqlServerOption = MYSQL_OPTION_MULTI_STATEMENTS_ON;
+      break;
+    case MYSQL_MSTATMENT_OFF_SOPT:
+      mysqlServerOption = MYSQL_OPTION_MULTI_STATEMENTS_OFF;
+      break;
+    default:
+      return mysql_prim_confl(interp,objc,objv,"Weirdness in server options");
+  }
+  if (mysql_set_server_option(handle->connection,mysqlServerOption)!=0) {
+  	mysql_server_confl(interp,objc,objv,handle->connection,handle);
+  } else {
+	handle->multiStatements = (mysqlServerOption == MYSQL_OPTION_MULTI_STATEMENTS_ON);
+  }
+  return TCL_OK;
+#endif
+}
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_ShutDown
+ *    usage: mysql::shutdown handle
+ *
+ */
+static int Mysqltcl_ShutDown(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqlTclHandle *handle;
+
+  if ((handle = mysql_prologue(interp, objc, objv, 2, 2, CL_CONN,
+			    "handle")) == 0)
+    return TCL_ERROR;
+#if (MYSQL_VERSION_ID >= 40107)
+  if (mysql_shutdown(handle->connection,SHUTDOWN_DEFAULT)!=0) {
+#else
+  if (mysql_shutdown(handle->connection)!=0) {
+#endif
+  	mysql_server_confl(interp,objc,objv,handle->connection,handle);
+  }
+  return TCL_OK;
+}
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Config
+ *    usage: mysql::config ?-status ?compat|lazy?? ?-timing ?boolean?? ?-histogram ?boolean??
+ *
+ */
+static int Mysqltcl_Config(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData;
+  int idx, mode;
+  Tcl_Obj *resList;
+
+  static CONST char* configOptions[] = {"-status", "-timing", "-histogram", NULL};
+  enum configoption {CONFIG_STATUS, CONFIG_TIMING, CONFIG_HISTOGRAM};
+  static CONST char* statusModes[] = {"compat", "lazy", NULL};
+
+  if (objc > 3) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?option ?value??");
+    return TCL_ERROR;
+  }
+  if (objc == 1) {
+    resList = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj(configOptions[CONFIG_STATUS],-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj(statusModes[statePtr->statusLazy],-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj(configOptions[CONFIG_TIMING],-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewBooleanObj(statePtr->statsTiming));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewStringObj(configOptions[CONFIG_HISTOGRAM],-1));
+    Tcl_ListObjAppendElement(interp, resList, Tcl_NewBooleanObj(statePtr->histogramOn));
+    Tcl_SetObjResult(interp, resList);
+    return TCL_OK;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], configOptions, "option",
+			  TCL_EXACT, &idx) != TCL_OK)
+    return TCL_ERROR;
+  switch (idx) {
+  case CONFIG_STATUS:
+    if (objc == 3) {
+      if (Tcl_GetIndexFromObj(interp, objv[2], statusModes, "status mode",
+			      TCL_EXACT, &mode) != TCL_OK)
+	return TCL_ERROR;
+      setStatusMode(statePtr, mode);
+    }
+    set_statusCode(interp,statePtr,0);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(statusModes[statePtr->statusLazy],-1));
+    break;
+  case CONFIG_TIMING:
+    if (objc == 3 && Tcl_GetBooleanFromObj(interp, objv[2], &statePtr->statsTiming) != TCL_OK)
+      return TCL_ERROR;
+    set_statusCode(interp,statePtr,0);
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(statePtr->statsTiming));
+    break;
+  case CONFIG_HISTOGRAM:
+    if (objc == 3 && Tcl_GetBooleanFromObj(interp, objv[2], &statePtr->histogramOn) != TCL_OK)
+      return TCL_ERROR;
+    set_statusCode(interp,statePtr,0);
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(statePtr->histogramOn));
+    break;
+  }
+  return TCL_OK;
+}
+
+/*
+ * Add counters of stats as dict elements to dict.
+ */
+static void appendStats(Tcl_Obj *dict,MysqlStats *stats)
+{
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("queries",-1), Tcl_NewWideIntObj(stats->queries));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("rows",-1), Tcl_NewWideIntObj(stats->rows));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("bytessent",-1), Tcl_NewWideIntObj(stats->bytesSent));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("bytesreceived",-1), Tcl_NewWideIntObj(stats->bytesReceived));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("encoded",-1), Tcl_NewWideIntObj(stats->encoded));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("decoded",-1), Tcl_NewWideIntObj(stats->decoded));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("servertime",-1), Tcl_NewWideIntObj(stats->serverTime));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("converttime",-1), Tcl_NewWideIntObj(stats->convertTime));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("errors",-1), Tcl_NewWideIntObj(stats->errors));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("reconnects",-1), Tcl_NewWideIntObj(stats->reconnects));
+}
+
+static void addStats(MysqlStats *sum,MysqlStats *stats)
+{
+  sum->queries += stats->queries;
+  sum->rows += stats->rows;
+  sum->bytesSent += stats->bytesSent;
+  sum->bytesReceived += stats->bytesReceived;
+  sum->encoded += stats->encoded;
+  sum->decoded += stats->decoded;
+  sum->serverTime += stats->serverTime;
+  sum->convertTime += stats->convertTime;
+  sum->errors += stats->errors;
+  sum->reconnects += stats->reconnects;
+}
+
+/* clear counters, but keep the connection id for counting of reconnects */
+static void resetStats(MysqlStats *stats)
+{
+  unsigned long threadId = stats->threadId;
+  memset(stats,0,sizeof(MysqlStats));
+  stats->threadId = threadId;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Stats
+ *    usage: mysql::stats ?handle? ?-reset?
+ *
+ *    results:
+ *	    dict of counters of connection or of all connections
+ *	    (with closed ones) of interpreter. -reset clears the counters
+ *	    after reading.
+ */
+static int Mysqltcl_Stats(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData;
+  MysqlTclHandle *handle;
+  MysqlStats sum;
+  Tcl_Obj *dict;
+  int i, reset = 0;
+
+  if (objc > 1 && strcmp(Tcl_GetString(objv[objc-1]), "-reset") == 0) {
+    reset = 1;
+    objc--;
+  }
+  if (objc > 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?handle? ?-reset?");
+    return TCL_ERROR;
+  }
+  if (objc == 2) {
+    if ((handle = mysql_prologue(interp, objc, objv, 2, 2, CL_CONN,
+				 "?handle? ?-reset?")) == 0)
+      return TCL_ERROR;
+    dict = Tcl_NewDictObj();
+    appendStats(dict,handleStats(handle));
+    if (reset) resetStats(handleStats(handle));
+  } else {
+    sum = statePtr->closedStats;
+    for (i = 0; i < statePtr->slotsUsed; i++) {
+      handle = statePtr->slots[i].handle;
+      if (handle != NULL) addStats(&sum,&handle->stats);
+    }
+    dict = Tcl_NewDictObj();
+    appendStats(dict,&sum);
+    if (reset) {
+      memset(&statePtr->closedStats,0,sizeof(MysqlStats));
+      for (i = 0; i < statePtr->slotsUsed; i++) {
+	handle = statePtr->slots[i].handle;
+	if (handle != NULL) resetStats(&handle->stats);
+      }
+    }
+    set_statusCode(interp,statePtr,0);
+  }
+  Tcl_SetObjResult(interp, dict);
+  return TCL_OK;
+}
+
+/*
+ * Trace entry as dict for mysql::trace dump and callback.
+ */
+static Tcl_Obj *traceEntryDict(MysqlTraceEntry *entry)
+{
+  Tcl_Obj *dict;
+  char buffer[MYSQL_HPREFIX_LEN+TCL_INTEGER_SPACE*2+1];
+
+  sprintf(buffer, "%s%" TCL_LL_MODIFIER "d", (entry->type==HT_QUERY) ? "query" : MysqlHandlePrefix, entry->handle);
+  dict = Tcl_NewDictObj();
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("seq",-1), Tcl_NewWideIntObj(entry->seq));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("handle",-1), Tcl_NewStringObj(buffer,-1));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("time",-1), Tcl_NewWideIntObj(entry->time));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("duration",-1), Tcl_NewWideIntObj(entry->duration));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("rows",-1), Tcl_NewWideIntObj(entry->rows));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("error",-1), Tcl_NewIntObj(entry->error));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("sql",-1), Tcl_NewStringObj(entry->sql,-1));
+  return dict;
+}
+
+static void freeTrace(MysqlTrace *trace)
+{
+  Tcl_Free((char *)trace->entries);
+  if (trace->command != NULL) Tcl_DecrRefCount(trace->command);
+  Tcl_DecrRefCount(trace->pending);
+  Tcl_Free((char *)trace);
+}
+
+/*
+ * Async handler of trace: call the callback for the queued statements
+ * over threshold. It runs at the next safe point after the command
+ * that executed the statement, so the callback can use mysqltcl commands.
+ */
+static int Mysqltcl_TraceCallback(ClientData clientData, Tcl_Interp *currentInterp, int code)
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData;
+  Tcl_Interp *interp = statePtr->interp;
+  Tcl_InterpState interpState;
+  Tcl_Obj *pending, **seqObjv, *cmdObj;
+  MysqlTraceEntry *entry;
+  Tcl_WideInt seq;
+  int seqCount, i;
+
+  if (statePtr->trace == NULL || statePtr->trace->inCallback) return code;
+  pending = statePtr->trace->pending;
+  statePtr->trace->pending = Tcl_NewObj();
+  Tcl_IncrRefCount(statePtr->trace->pending);
+
+  Tcl_Preserve((ClientData)interp);
+  interpState = Tcl_SaveInterpState(interp, code);
+  Tcl_ListObjGetElements(NULL, pending, &seqCount, &seqObjv);
+  for (i = 0; i < seqCount; i++) {
+    /* the callback can stop the trace */
+    if (statePtr->trace == NULL || statePtr->trace->command == NULL) break;
+    Tcl_GetWideIntFromObj(NULL, seqObjv[i], &seq);
+    if ((entry = traceEntry(statePtr,seq)) == NULL) continue;
+    cmdObj = Tcl_DuplicateObj(statePtr->trace->command);
+    Tcl_IncrRefCount(cmdObj);
+    Tcl_ListObjAppendElement(NULL, cmdObj, traceEntryDict(entry));
+    statePtr->trace->inCallback = 1;
+    if (Tcl_EvalObjEx(interp, cmdObj, TCL_EVAL_GLOBAL) == TCL_ERROR) {
+      Tcl_AddErrorInfo(interp, "\n    (mysql::trace callback)");
+      Tcl_BackgroundError(interp);
+    }
+    if (statePtr->trace != NULL) statePtr->trace->inCallback = 0;
+    Tcl_DecrRefCount(cmdObj);
+  }
+  Tcl_DecrRefCount(pending);
+  code = Tcl_RestoreInterpState(interp, interpState);
+  Tcl_Release((ClientData)interp);
+  return code;
+}
+
+/*
+ * Summary of histogram as dict; values in microseconds are upper bounds
+ * of buckets (min is the lower bound).
+ */
+static Tcl_Obj *histogramDict(MysqlHistogram *histogram)
+{
+  static CONST char* percentileNames[] = {"p50", "p90", "p99", "p999"};
+  static CONST int permille[] = {500, 900, 990, 999};
+  Tcl_Obj *dict;
+  Tcl_WideInt seen = 0, low = 0, high = 0, values[4];
+  int idx, p = 0;
+
+  memset(values,0,sizeof(values));
+  for (idx = 0; idx < MYSQL_HIST_BUCKETS; idx++) {
+    if (histogram->buckets[idx] <= 0) continue;
+    if (seen == 0) low = histBucketLow(idx);
+    high = histBucketHigh(idx);
+    seen += histogram->buckets[idx];
+    while (p < 4 && seen*1000 >= histogram->count*permille[p]) {
+      values[p++] = high;
+    }
+  }
+  dict = Tcl_NewDictObj();
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("count",-1), Tcl_NewWideIntObj(histogram->count));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("mean",-1),
+		 Tcl_NewWideIntObj((histogram->count > 0) ? histogram->sum/histogram->count : 0));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("min",-1), Tcl_NewWideIntObj(low));
+  Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("max",-1), Tcl_NewWideIntObj(high));
+  for (p = 0; p < 4; p++) {
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(percentileNames[p],-1), Tcl_NewWideIntObj(values[p]));
+  }
+  return dict;
+}
+
+/*
+ * Delete histograms; all or only entryPtr. Handles recording into them
+ * see the new generation.
+ */
+static void deleteHistograms(MysqltclState *statePtr,Tcl_HashEntry *entryPtr)
+{
+  Tcl_HashSearch search;
+
+  statePtr->histGeneration++;
+  if (entryPtr != NULL) {
+    Tcl_Free((char *)Tcl_GetHashValue(entryPtr));
+    Tcl_DeleteHashEntry(entryPtr);
+    return;
+  }
+  for (entryPtr = Tcl_FirstHashEntry(&statePtr->histograms,&search);
+       entryPtr != NULL;
+       entryPtr = Tcl_NextHashEntry(&search)) {
+    Tcl_Free((char *)Tcl_GetHashValue(entryPtr));
+  }
+  Tcl_DeleteHashTable(&statePtr->histograms);
+  Tcl_InitHashTable(&statePtr->histograms, TCL_STRING_KEYS);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Histogram
+ *    usage: mysql::histogram ?-fingerprint sql? ?-reset?
+ *
+ *    results:
+ *	    dict of fingerprint and its summary (count, mean, min, max,
+ *	    p50, p90, p99, p999) or summary of fingerprint of sql.
+ *	    -reset deletes the returned histograms.
+ */
+static int Mysqltcl_Histogram(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData;
+  MysqlHistogram empty;
+  Tcl_HashEntry *entryPtr;
+  Tcl_HashSearch search;
+  Tcl_Obj *dict, *sqlObj = NULL;
+  char fp[MYSQL_FINGERPRINT_LEN];
+  const char *sql;
+  int i, idx, length, reset = 0;
+
+  static CONST char* histOptions[] = {"-fingerprint", "-reset", NULL};
+  enum histoption {HIST_FINGERPRINT, HIST_RESET};
+
+  for (i = 1; i < objc; i++) {
+    if (Tcl_GetIndexFromObj(interp, objv[i], histOptions, "option",
+			    TCL_EXACT, &idx) != TCL_OK)
+      return TCL_ERROR;
+    if (idx == HIST_RESET) {
+      reset = 1;
+    } else if (++i < objc) {
+      sqlObj = objv[i];
+    } else {
+      Tcl_WrongNumArgs(interp, 1, objv, "?-fingerprint sql? ?-reset?");
+      return TCL_ERROR;
+    }
+  }
+  set_statusCode(interp,statePtr,0);
+
+  if (sqlObj != NULL) {
+    sql = Tcl_GetStringFromObj(sqlObj, &length);
+    sqlFingerprint(sql,length,fp);
+    entryPtr = Tcl_FindHashEntry(&statePtr->histograms,fp);
+    if (entryPtr != NULL) {
+      Tcl_SetObjResult(interp, histogramDict((MysqlHistogram *)Tcl_GetHashValue(entryPtr)));
+      if (reset) deleteHistograms(statePtr,entryPtr);
+    } else {
+      memset(&empty,0,sizeof(MysqlHistogram));
+      Tcl_SetObjResult(interp, histogramDict(&empty));
+    }
+    return TCL_OK;
+  }
+  dict = Tcl_NewDictObj();
+  for (entryPtr = Tcl_FirstHashEntry(&statePtr->histograms,&search);
+       entryPtr != NULL;
+       entryPtr = Tcl_NextHashEntry(&search)) {
+    Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(Tcl_GetHashKey(&statePtr->histograms,entryPtr),-1),
+		   histogramDict((MysqlHistogram *)Tcl_GetHashValue(entryPtr)));
+  }
+  if (reset) deleteHistograms(statePtr,NULL);
+  Tcl_SetObjResult(interp, dict);
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Trace
+ *    usage: mysql::trace on ?-size n? ?-threshold microseconds? ?-command cmdPrefix?
+ *           mysql::trace off
+ *           mysql::trace dump ?-clear?
+ *
+ *    results:
+ *	    dump returns the traced statements as list of dicts, oldest first
+ */
+static int Mysqltcl_Trace(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData;
+  MysqlTrace *trace = statePtr->trace;
+  MysqlTraceEntry *entry;
+  Tcl_Obj *resList, *command = NULL;
+  Tcl_WideInt threshold = -1, seq;
+  int idx, i, size = 0, hasCommand = 0;
+
+  static CONST char* traceCommands[] = {"on", "off", "dump", NULL};
+  enum tracecommand {TRACE_ON, TRACE_OFF, TRACE_DUMP};
+  static CONST char* traceOptions[] = {"-size", "-threshold", "-command", NULL};
+  enum traceoption {TRACE_SIZE, TRACE_THRESHOLD, TRACE_COMMAND};
+
+  if (objc < 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "on|off|dump ?arg ...?");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj(interp, objv[1], traceCommands, "subcommand",
+			  TCL_EXACT, &idx) != TCL_OK)
+    return TCL_ERROR;
+  set_statusCode(interp,statePtr,0);
+
+  switch (idx) {
+  case TRACE_ON:
+    if (objc % 2 != 0) {
+      Tcl_WrongNumArgs(interp, 2, objv, "?-size n? ?-threshold microseconds? ?-command cmdPrefix?");
+      return TCL_ERROR;
+    }
+    for (i = 2; i < objc; i += 2) {
+      if (Tcl_GetIndexFromObj(interp, objv[i], traceOptions, "option",
+			      TCL_EXACT, &idx) != TCL_OK)
+	return TCL_ERROR;
+      switch (idx) {
+      case TRACE_SIZE:
+	if (Tcl_GetIntFromObj(interp, objv[i+1], &size) != TCL_OK)
+	  return TCL_ERROR;
+	if (size < 1)
+	  return mysql_prim_confl(interp,objc,objv,"trace size must be positive");
+	break;
+      case TRACE_THRESHOLD:
+	if (Tcl_GetWideIntFromObj(interp, objv[i+1], &threshold) != TCL_OK)
+	  return TCL_ERROR;
+	break;
+      case TRACE_COMMAND:
+	hasCommand = 1;
+	command = (Tcl_GetCharLength(objv[i+1]) > 0) ? objv[i+1] : NULL;
+	break;
+      }
+    }
+    if (trace != NULL && size > 0 && size != trace->size) {
+      /* new ring buffer, old entries are lost */
+      Tcl_Free((char *)trace->entries);
+      trace->entries = NULL;
+    }
+    if (trace == NULL) {
+      trace = (MysqlTrace *)Tcl_Alloc(sizeof(MysqlTrace));
+      memset(trace,0,sizeof(MysqlTrace));
+      trace->size = MYSQL_TRACE_SIZE;
+      trace->pending = Tcl_NewObj();
+      Tcl_IncrRefCount(trace->pending);
+      statePtr->trace = trace;
+    }
+    if (trace->entries == NULL) {
+      if (size > 0) trace->size = size;
+      trace->entries = (MysqlTraceEntry *)Tcl_Alloc(sizeof(MysqlTraceEntry)*trace->size);
+      memset(trace->entries,0,sizeof(MysqlTraceEntry)*trace->size);
+      trace->first = statePtr->traceCount+1;
+    }
+    if (threshold >= 0) trace->threshold = threshold;
+    if (hasCommand) {
+      if (trace->command != NULL) Tcl_DecrRefCount(trace->command);
+      trace->command = command;
+      if (command != NULL) Tcl_IncrRefCount(command);
+    }
+    if (trace->command != NULL && statePtr->traceAsync == NULL) {
+      statePtr->traceAsync = Tcl_AsyncCreate(Mysqltcl_TraceCallback, (ClientData)statePtr);
+    }
+    break;
+  case TRACE_OFF:
+    if (objc != 2) {
+      Tcl_WrongNumArgs(interp, 2, objv, "");
+      return TCL_ERROR;
+    }
+    if (trace != NULL) {
+      statePtr->trace = NULL;
+      freeTrace(trace);
+    }
+    break;
+  case TRACE_DUMP:
+    if (objc > 3 || (objc == 3 && strcmp(Tcl_GetString(objv[2]), "-clear") != 0)) {
+      Tcl_WrongNumArgs(interp, 2, objv, "?-clear?");
+      return TCL_ERROR;
+    }
+    resList = Tcl_NewListObj(0, NULL);
+    if (trace != NULL) {
+      seq = statePtr->traceCount-trace->size+1;
+      if (seq < trace->first) seq = trace->first;
+      for (; seq <= statePtr->traceCount; seq++) {
+	if ((entry = traceEntry(statePtr,seq)) != NULL)
+	  Tcl_ListObjAppendElement(NULL, resList, traceEntryDict(entry));
+      }
+      if (objc == 3) trace->first = statePtr->traceCount+1;
+    }
+    Tcl_SetObjResult(interp, resList);
+    break;
+  }
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Encoding
+ *    usage: mysql::encoding handle ?encoding|binary?
+ *
+ */
+static int Mysqltcl_Encoding(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+  MysqlTclHandle *handle,*qhandle;
+  char *encodingname;
+  Tcl_Encoding encoding;
+  
+  if ((handle = mysql_prologue(interp, objc, objv, 2, 3, CL_CONN,
+			    "handle")) == 0)
+        return TCL_ERROR;
+  if (objc==2) {
+      if (handle->encoding == NULL)
+         Tcl_SetObjResult(interp, Tcl_NewStringObj("binary",-1));
+      else 
+         Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_GetEncodingName(handle->encoding),-1));
+  } else {
+      if (handle->type!=HT_CONNECTION) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("encoding set can be used only on connection handle",-1));
+            return TCL_ERROR;
+      }
+      encodingname = Tcl_GetStringFromObj(objv[2],NULL);
+      if (strcmp(encodingname, "binary") == 0) {
+	 encoding = NULL;	
+      } else {
+         encoding = Tcl_GetEncoding(interp, encodingname);
+	 if (encoding == NULL)
+	     return TCL_ERROR;
+      }
+      if (handle->encoding!=NULL)
+          Tcl_FreeEncoding(handle->encoding);
+      handle->encoding = encoding;
+      /* the plan may be in use by running mysql::map, so update it in place */
+      if (handle->colPlan!=NULL)
+          fillColumnPlan(handle);
+
+      /* change encoding of all queries and statements, they share the encoding */
+      for (qhandle = handle->firstChild; qhandle != NULL; qhandle = qhandle->nextSibling) {
+            qhandle->encoding = encoding;
+            if (qhandle->type==HT_QUERY && qhandle->colPlan!=NULL)
+                fillColumnPlan(qhandle);
+#ifdef PREPARED_STATEMENT
+            if (qhandle->type==HT_STATEMENT && qhandle->stmt!=NULL)
+                fillStatementPlan(qhandle,qhandle->stmt);
+#endif
+      }
+#ifdef PREPARED_STATEMENT
+      /* cached statements were prepared from text in the old encoding */
+      if (handle->stmtCache!=NULL)
+          flushStmtCache(handle->stmtCache);
+#endif
+
+  }
+  return TCL_OK;
+}
+/*
+ *----------------------------------------------------------------------
+ *
+ * Mysqltcl_Close --
+ *    Implements the mysqlclose command:
+ *    usage: mysqlclose ?handle?
+ *	                
+ *    results:
+ *	null string
+ */
+
+static int Mysqltcl_Close(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+
+{
+  MysqltclState *statePtr = (MysqltclState *)clientData; 
+  MysqlTclHandle *handle;
+
+  /* If handle omitted, close all connections. */
+  if (objc == 1) {
+      Mysqltcl_CloseAll(clientData) ;
+      return TCL_OK ;
+  }
+  
+  /* a pending asynchronous query does not prevent closing */
+  if ((handle = mysql_prologue(interp, objc, objv, 2, 2, CL_PLAIN,
+			    "?handle?")) == 0)
+    return TCL_ERROR;
+  if (handle->connection == 0)
+    return mysql_prim_confl(interp,objc,objv,"handle already closed (dangling pointer)") ;
+
+  closeHandleWithQueries(statePtr,handle);
+  return TCL_OK;
+}
+
+#ifdef PREPARED_STATEMENT
+/*
+ * Prepared statements
+ * Parameters are bound from the Tcl type of the argument (integer, double,
+ * byte array, null object or string); numbers and byte arrays only if
+ * they have no string rep. Results are fetched in binary protocol
+ * into buffers allocated once from the result metadata: integer and double
+ * columns as numbers, all other columns as text or binary data.
+ */
+
+static int mysql_stmt_confl(Tcl_Interp *interp,int objc,Tcl_Obj *CONST objv[],MYSQL_STMT *statement,MysqlTclHandle *handle)
+{
+  const char* mysql_errorMsg;
+  if (mysql_stmt_errno(statement)) {
+    mysql_errorMsg = mysql_stmt_error(statement);
+
+    set_statusCode(interp,NULL,mysql_stmt_errno(statement));
+    statsError(handle);
+
+    Tcl_ResetResult(interp) ;
+    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                          Tcl_GetString(objv[0]), "/db server: ",
+		          (mysql_errorMsg == NULL) ? "" : mysql_errorMsg,
+                          (char*)NULL) ;
+
+    set_statusArr(interp,MYSQL_STATUS_MSG,Tcl_GetObjResult(interp));
+
+    mysql_reassemble(interp,objc,objv);
+    return TCL_ERROR;
+  } else {
+    return TCL_OK;
+  }
+}
+
+/*
+ * Compute the conversion of every result column of statement. Numbers are
+ * fetched always as numbers, FLOAT as text of server. The buffer types do
+ * not depend on encoding, so the plan can change after binding.
+ */
+static void fillStatementPlan(MysqlTclHandle *handle,MysqlStatement *stmt)
+{
+  MYSQL_FIELD *fields;
+  MysqlStmtValue *value;
+  int i, utf8;
+
+  if (stmt->resultMetadata == NULL) return;
+  fields = mysql_fetch_fields(stmt->resultMetadata);
+  utf8 = isUtf8Handle(handle);
+  for (i = 0; i < stmt->colCount; i++) {
+    value = &stmt->resultValues[i];
+    value->conversion = columnConversion(handle,&fields[i],1,utf8);
+    if (fields[i].type == FIELD_TYPE_FLOAT)
+      value->conversion = (handle->encoding == NULL) ? CONV_BINARY : CONV_ASCII;
+  }
+}
+
+/*
+ * Create statement with parameter and result bindings for statement
+ * prepared on connection handle.
+ * The bindings are reused by all executions of the statement.
+ */
+static MysqlStatement *newStatement(MysqlTclHandle *handle,MYSQL_STMT *statement)
+{
+  MysqlStatement *stmt;
+  MYSQL_FIELD *fields;
+  MYSQL_BIND *bind;
+  MysqlStmtValue *value;
+  unsigned long size;
+  int i;
+  char *buf;
+
+  stmt = (MysqlStatement *)Tcl_Alloc(sizeof(MysqlStatement));
+  memset(stmt,0,sizeof(MysqlStatement));
+  stmt->statement = statement;
+  stmt->paramCount = mysql_stmt_param_count(statement);
+  if (stmt->paramCount > 0) {
+    stmt->bindParam = (MYSQL_BIND *)Tcl_Alloc(sizeof(MYSQL_BIND)*stmt->paramCount);
+    stmt->paramValues = (MysqlStmtValue *)Tcl_Alloc(sizeof(MysqlStmtValue)*stmt->paramCount);
+    stmt->paramStrings = (Tcl_DString *)Tcl_Alloc(sizeof(Tcl_DString)*stmt->paramCount);
+  }
+  stmt->resultMetadata = mysql_stmt_result_metadata(statement);
+  if (stmt->resultMetadata == NULL) return stmt;
+
+  stmt->colCount = mysql_num_fields(stmt->resultMetadata);
+  fields = mysql_fetch_fields(stmt->resultMetadata);
+  stmt->bindResult = (MYSQL_BIND *)Tcl_Alloc(sizeof(MYSQL_BIND)*stmt->colCount);
+  memset(stmt->bindResult,0,sizeof(MYSQL_BIND)*stmt->colCount);
+  stmt->resultValues = (MysqlStmtValue *)Tcl_Alloc(sizeof(MysqlStmtValue)*stmt->colCount);
+  memset(stmt->resultValues,0,sizeof(MysqlStmtValue)*stmt->colCount);
+
+  fillStatementPlan(handle,stmt);
+  size = 0;
+  for (i = 0; i < stmt->colCount; i++) {
+    bind = &stmt->bindResult[i];
+    value = &stmt->resultValues[i];
+    bind->length = &value->length;
+    bind->is_null = &value->isNull;
+    bind->error = &value->error;
+    switch (value->conversion) {
+    case CONV_WIDEINT:
+      bind->buffer_type = MYSQL_TYPE_LONGLONG;
+      bind->buffer = &value->num.wide;
+      bind->is_unsigned = (fields[i].flags & UNSIGNED_FLAG) != 0;
+      break;
+    case CONV_DOUBLE:
+      bind->buffer_type = MYSQL_TYPE_DOUBLE;
+      bind->buffer = &value->num.dbl;
+      break;
+    default:
+      bind->buffer_type = (value->conversion == CONV_BINARY) ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING;
+      bind->buffer_length = (fields[i].length < MYSQL_STMT_COLBUF_MAX) ? fields[i].length+1 : MYSQL_STMT_COLBUF_MAX;
+      size += bind->buffer_length;
+    }
+  }
+  if (size == 0) return stmt;
+  buf = stmt->resultBuf = Tcl_Alloc(size);
+  for (i = 0; i < stmt->colCount; i++) {
+    bind = &stmt->bindResult[i];
+    if (bind->buffer_length > 0) {
+      bind->buffer = buf;
+      buf += bind->buffer_length;
+    }
+  }
+  return stmt;
+}
+
+static void freeStatement(MysqlStatement *stmt)
+{
+  mysql_stmt_close(stmt->statement);
+  if (stmt->bindResult!=NULL)
+    Tcl_Free((char *)stmt->bindResult);
+  if (stmt->resultValues!=NULL)
+    Tcl_Free((char *)stmt->resultValues);
+  if (stmt->resultBuf!=NULL)
+    Tcl_Free(stmt->resultBuf);
+  if (stmt->rowObjv!=NULL)
+    Tcl_Free((char *)stmt->rowObjv);
+  if (stmt->bindParam!=NULL)
+    Tcl_Free((char *)stmt->bindParam);
+  if (stmt->paramValues!=NULL)
+    Tcl_Free((char *)stmt->paramValues);
+  if (stmt->paramStrings!=NULL)
+    Tcl_Free((char *)stmt->paramStrings);
+  if (stmt->resultMetadata!=NULL)
+    mysql_free_result(stmt->resultMetadata);
+  if (stmt->sql!=NULL)
+    Tcl_Free(stmt->sql);
+  Tcl_Free((char *)stmt);
+}
+
+/*
+ * Statement cache
+ */
+
+static void stmtCacheUnlink(MysqlStmtCache *cache,MysqlStatement *stmt)
+{
+  if (stmt->prev!=NULL) stmt->prev->next = stmt->next; else cache->first = stmt->next;
+  if (stmt->next!=NULL) stmt->next->prev = stmt->prev; else cache->last = stmt->prev;
+  stmt->prev = stmt->next = NULL;
+  Tcl_DeleteHashEntry(Tcl_FindHashEntry(&cache->table,stmt->sql));
+  cache->count--;
+}
+
+/*
+ * Close all idle statements; statements in use are not cached again.
+ * Used if the server has forgotten the statements (reconnect, changeuser).
+ */
+static void flushStmtCache(MysqlStmtCache *cache)
+{
+  MysqlStatement *stmt;
+
+  while ((stmt = cache->first) != NULL) {
+    stmtCacheUnlink(cache,stmt);
+    freeStatement(stmt);
+  }
+  cache->generation++;
+}
+
+static void freeStmtCache(MysqlStmtCache *cache)
+{
+  flushStmtCache(cache);
+  Tcl_DeleteHashTable(&cache->table);
+  Tcl_Free((char *)cache);
+}
+
+/*
+ * Take idle statement for sql from cache; NULL if there is none.
+ */
+static MysqlStatement *stmtCacheGet(MysqlTclHandle *handle,const char *sql)
+{
+  MysqlStmtCache *cache = handle->stmtCache;
+  Tcl_HashEntry *entryPtr;
+  MysqlStatement *stmt;
 
-  switch (idx) {
-    case MYSQL_MSTATMENT_ON_SOPT:
-      mysqlServerOption = MYSQL_OPTION_MULTI_STATEMENTS_ON;
-      break;
-    case MYSQL_MSTATMENT_OFF_SOPT:
-      mysqlServerOption = MYSQL_OPTION_MULTI_STATEMENTS_OFF;
-      break;
-    default:
-      return mysql_prim_confl(interp,objc,objv,"Weirdness in server options");
+  /* reconnect gives new session without statements */
+  if (mysql_thread_id(handle->connection) != cache->threadId) {
+    flushStmtCache(cache);
+    cache->threadId = mysql_thread_id(handle->connection);
   }
-  if (mysql_set_server_option(handle->connection,mysqlServerOption)!=0) {
-  	mysql_server_confl(interp,objc,objv,handle->connection);
+  entryPtr = Tcl_FindHashEntry(&cache->table,sql);
+  if (entryPtr == NULL) {
+    cache->misses++;
+    return NULL;
   }
-  return TCL_OK;
-#endif
+  cache->hits++;
+  stmt = (MysqlStatement *)Tcl_GetHashValue(entryPtr);
+  stmtCacheUnlink(cache,stmt);
+  return stmt;
 }
+
 /*
- *----------------------------------------------------------------------
- *
- * Mysqltcl_ShutDown
- *    usage: mysql::shutdown handle
- *
+ * Give statement of closed statement handle back to cache
+ * or close it.
  */
-static int Mysqltcl_ShutDown(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+static void releaseStatement(MysqlTclHandle *handle)
 {
-  MysqlTclHandle *handle;
+  MysqlStmtCache *cache = handle->stmtCache;
+  MysqlStatement *stmt = handle->stmt;
+  Tcl_HashEntry *entryPtr;
+  int newflag;
 
-  if ((handle = mysql_prologue(interp, objc, objv, 2, 2, CL_CONN,
-			    "handle")) == 0)
-    return TCL_ERROR;
-#if (MYSQL_VERSION_ID >= 40107)
-  if (mysql_shutdown(handle->connection,SHUTDOWN_DEFAULT)!=0) {
-#else
-  if (mysql_shutdown(handle->connection)!=0) {
-#endif
-  	mysql_server_confl(interp,objc,objv,handle->connection);
+  handle->stmt = NULL;
+  if (cache == NULL || stmt->sql == NULL || stmt->generation != cache->generation ||
+      mysql_thread_id(handle->connection) != cache->threadId) {
+    freeStatement(stmt);
+    return;
+  }
+  entryPtr = Tcl_CreateHashEntry(&cache->table,stmt->sql,&newflag);
+  if (!newflag) {
+    /* same statement was prepared twice */
+    freeStatement(stmt);
+    return;
+  }
+  mysql_stmt_free_result(stmt->statement);
+  Tcl_SetHashValue(entryPtr,stmt);
+  stmt->prev = cache->last;
+  stmt->next = NULL;
+  if (cache->last!=NULL) cache->last->next = stmt; else cache->first = stmt;
+  cache->last = stmt;
+  cache->count++;
+  while (cache->count > cache->size) {
+    stmt = cache->first;
+    stmtCacheUnlink(cache,stmt);
+    freeStatement(stmt);
   }
-  return TCL_OK;
 }
+
 /*
- *----------------------------------------------------------------------
- *
- * Mysqltcl_Encoding
- *    usage: mysql::encoding handle ?encoding|binary?
- *
+ * Bind count values as parameters of statement; objc and objv are used
+ * for error messages.
+ * The Tcl type selects the parameter type, so numbers are not converted to text.
+ * Strings are given as they are on utf-8 connections, other ones are converted
+ * into handle->stmt->paramStrings (freed after execution).
  */
-static int Mysqltcl_Encoding(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+static int bindStatementParams(Tcl_Interp *interp,MysqlTclHandle *handle,int objc,Tcl_Obj *CONST objv[],
+			       int count,Tcl_Obj *CONST values[])
 {
-  MysqltclState *statePtr = (MysqltclState *)clientData;
-  Tcl_HashSearch search;
-  Tcl_HashEntry *entryPtr;
-  MysqlTclHandle *handle,*qhandle;
-  char *encodingname;
-  Tcl_Encoding encoding;
-  
-  if ((handle = mysql_prologue(interp, objc, objv, 2, 3, CL_CONN,
-			    "handle")) == 0)
-        return TCL_ERROR;
-  if (objc==2) {
-      if (handle->encoding == NULL)
-         Tcl_SetObjResult(interp, Tcl_NewStringObj("binary",-1));
-      else 
-         Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_GetEncodingName(handle->encoding),-1));
-  } else {
-      if (handle->type!=HT_CONNECTION) {
-            Tcl_SetObjResult(interp, Tcl_NewStringObj("encoding set can be used only on connection handle",-1));
-            return TCL_ERROR;
-      }
-      encodingname = Tcl_GetStringFromObj(objv[2],NULL);
-      if (strcmp(encodingname, "binary") == 0) {
-	 encoding = NULL;	
-      } else {
-         encoding = Tcl_GetEncoding(interp, encodingname);
-	 if (encoding == NULL)
-	     return TCL_ERROR;
-      }
-      if (handle->encoding!=NULL)
-          Tcl_FreeEncoding(handle->encoding);
-      handle->encoding = encoding;
+  MYSQL_BIND *bind;
+  MysqlStmtValue *value;
+  Tcl_Obj *obj;
+  char *str, msg[60];
+  int i, len, utf8;
 
-      /* change encoding of all subqueries */
-      for (entryPtr=Tcl_FirstHashEntry(&statePtr->hash,&search);
-               entryPtr!=NULL;
-                entryPtr=Tcl_NextHashEntry(&search)) {
-            qhandle=(MysqlTclHandle *)Tcl_GetHashValue(entryPtr);
-            if (qhandle->type==HT_QUERY && handle->connection==qhandle->connection) {
-                qhandle->encoding = encoding;
-            }
+  if (count != handle->stmt->paramCount) {
+    sprintf(msg, "statement needs %d parameters", handle->stmt->paramCount);
+    return mysql_prim_confl(interp,objc,objv,msg);
+  }
+  if (handle->stmt->paramCount == 0) return TCL_OK;
+
+  utf8 = isUtf8Handle(handle);
+  memset(handle->stmt->bindParam,0,sizeof(MYSQL_BIND)*handle->stmt->paramCount);
+  for (i = 0; i < handle->stmt->paramCount; i++) {
+    obj = values[i];
+    bind = &handle->stmt->bindParam[i];
+    value = &handle->stmt->paramValues[i];
+    value->length = 0;
+    bind->length = &value->length;
+    if (obj->typePtr == &mysqlNullType) {
+      bind->buffer_type = MYSQL_TYPE_NULL;
+    } else if (obj->bytes == NULL && obj->typePtr != NULL && (obj->typePtr == intType || obj->typePtr == wideIntType) &&
+	       Tcl_GetWideIntFromObj(NULL, obj, &value->num.wide) == TCL_OK) {
+      /* only pure numbers, a string rep (0123, 0x10, 1e3) is sent as written */
+      bind->buffer_type = MYSQL_TYPE_LONGLONG;
+      bind->buffer = &value->num.wide;
+    } else if (obj->bytes == NULL && obj->typePtr != NULL && obj->typePtr == doubleType &&
+	       Tcl_GetDoubleFromObj(NULL, obj, &value->num.dbl) == TCL_OK) {
+      bind->buffer_type = MYSQL_TYPE_DOUBLE;
+      bind->buffer = &value->num.dbl;
+    } else if ((obj->bytes == NULL && obj->typePtr == byteArrayType) || handle->encoding == NULL) {
+      bind->buffer_type = MYSQL_TYPE_BLOB;
+      bind->buffer = Tcl_GetByteArrayFromObj(obj, &len);
+      value->length = len;
+    } else {
+      bind->buffer_type = MYSQL_TYPE_STRING;
+      str = Tcl_GetStringFromObj(obj, &len);
+      if (!utf8 || !isTclUtf((unsigned char *)str, len)) {
+	str = Tcl_UtfToExternalDString(handle->encoding, str, len, &handle->stmt->paramStrings[i]);
+	len = Tcl_DStringLength(&handle->stmt->paramStrings[i]);
+	handle->encodedBytes += len;
       }
-
+      bind->buffer = str;
+      value->length = len;
+    }
   }
+  if (mysql_stmt_bind_param(handle->stmt->statement, handle->stmt->bindParam))
+    return mysql_stmt_confl(interp,objc,objv,handle->stmt->statement,handle);
   return TCL_OK;
 }
+
 /*
- *----------------------------------------------------------------------
- *
- * Mysqltcl_Close --
- *    Implements the mysqlclose command:
- *    usage: mysqlclose ?handle?
- *	                
- *    results:
- *	null string
+ * Execute statement once with count values as parameters.
  */
+static int executeParams(Tcl_Interp *interp,MysqlTclHandle *handle,int objc,Tcl_Obj *CONST objv[],
+			 int count,Tcl_Obj *CONST values[])
+{
+  int i, result;
+  Tcl_WideInt start;
 
-static int Mysqltcl_Close(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+  for (i = 0; i < handle->stmt->paramCount; i++) {
+    Tcl_DStringInit(&handle->stmt->paramStrings[i]);
+  }
+  result = bindStatementParams(interp,handle,objc,objv,count,values);
+  if (result == TCL_OK) {
+    stmtBegin(handle,handle->stmt->sql,(handle->stmt->sql != NULL) ? (int)strlen(handle->stmt->sql) : 0,0);
+    start = statsStart(handle);
+    if (mysql_stmt_execute(handle->stmt->statement))
+      result = mysql_stmt_confl(interp,objc,objv,handle->stmt->statement,handle);
+    statsServerTime(handle,start);
+    statsQuery(handle,0);
+    stmtEnd(handle,(result == TCL_OK && handle->stmt->colCount == 0) ?
+	    (Tcl_WideInt)mysql_stmt_affected_rows(handle->stmt->statement) : -1,
+	    mysql_stmt_errno(handle->stmt->statement));
+  }
+  for (i = 0; i < handle->stmt->paramCount; i++) {
+    Tcl_DStringFree(&handle->stmt->paramStrings[i]);
+  }
+  return result;
+}
 
+/*
+ * Execute statement with arguments from objv[2] on. A result is stored
+ * on client side and can be read by mysql::pfetch.
+ */
+static int executeStatement(Tcl_Interp *interp,MysqlTclHandle *handle,int objc,Tcl_Obj *CONST objv[])
 {
-  MysqltclState *statePtr = (MysqltclState *)clientData; 
-  MysqlTclHandle *handle,*thandle;
-  Tcl_HashEntry *entryPtr;
-  Tcl_HashEntry *qentries[16];
-  Tcl_HashSearch search;
+  Tcl_WideInt start;
 
-  int i,qfound = 0;
+  if (handle->type!=HT_STATEMENT)
+    return mysql_prim_confl(interp,objc,objv,"handle is not a prepared statement");
+  /* discard rows of last execution */
+  mysql_stmt_free_result(handle->stmt->statement);
+  handle->res_count = 0;
 
-
-  /* If handle omitted, close all connections. */
-  if (objc == 1) {
-      Mysqltcl_CloseAll(clientData) ;
-      return TCL_OK ;
-  }
-  
-  if ((handle = mysql_prologue(interp, objc, objv, 2, 2, CL_CONN,
-			    "?handle?")) == 0)
+  if (executeParams(interp,handle,objc,objv,objc-2,objv+2) != TCL_OK)
     return TCL_ERROR;
 
+  if (handle->stmt->colCount > 0) {
+    start = statsStart(handle);
+    if (mysql_stmt_bind_result(handle->stmt->statement, handle->stmt->bindResult) ||
+	mysql_stmt_store_result(handle->stmt->statement)) {
+      stmtEnd(handle,-1,mysql_stmt_errno(handle->stmt->statement));
+      return mysql_stmt_confl(interp,objc,objv,handle->stmt->statement,handle);
+    }
+    statsServerTime(handle,start);
+    handle->res_count = (int)mysql_stmt_num_rows(handle->stmt->statement);
+    stmtEnd(handle,handle->res_count,0);
+  }
+  return TCL_OK;
+}
 
-  /* Search all queries and statements on this handle and close those */
-  if (handle->type==HT_CONNECTION)  {
-    while (1) {
-      for (entryPtr=Tcl_FirstHashEntry(&statePtr->hash,&search); 
-	   entryPtr!=NULL;
-	   entryPtr=Tcl_NextHashEntry(&search)) {
+#ifdef BULK_EXECUTE
+/*
+ * Type of array bound parameter for all non NULL values of column c
+ * in rows start..end-1. Columns with mixed types are sent as text.
+ */
+static enum enum_field_types bulkColumnType(MysqlTclHandle *handle,Tcl_Obj *CONST rowObjv[],int start,int end,int c)
+{
+  enum enum_field_types columnType = MYSQL_TYPE_NULL, type;
+  Tcl_Obj **valObjv, *obj;
+  Tcl_WideInt wideValue;
+  int r, valCount;
+
+  for (r = start; r < end; r++) {
+    Tcl_ListObjGetElements(NULL, rowObjv[r], &valCount, &valObjv);
+    obj = valObjv[c];
+    if (obj->typePtr == &mysqlNullType) continue;
+    /* like bindStatementParams only pure numbers */
+    if (obj->bytes == NULL && obj->typePtr != NULL && (obj->typePtr == intType || obj->typePtr == wideIntType) &&
+	Tcl_GetWideIntFromObj(NULL, obj, &wideValue) == TCL_OK) {
+      type = MYSQL_TYPE_LONGLONG;
+    } else if (obj->bytes == NULL && obj->typePtr != NULL && obj->typePtr == doubleType) {
+      type = MYSQL_TYPE_DOUBLE;
+    } else if ((obj->bytes == NULL && obj->typePtr == byteArrayType) || handle->encoding == NULL) {
+      type = MYSQL_TYPE_BLOB;
+    } else {
+      type = MYSQL_TYPE_STRING;
+    }
+    if (columnType == MYSQL_TYPE_NULL) {
+      columnType = type;
+    } else if (columnType != type) {
+      return (handle->encoding == NULL) ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING;
+    }
+  }
+  return (columnType == MYSQL_TYPE_NULL) ? MYSQL_TYPE_STRING : columnType;
+}
 
-	thandle=(MysqlTclHandle *)Tcl_GetHashValue(entryPtr);
-	if (thandle->connection == handle->connection &&
-	    thandle->type!=HT_CONNECTION) {
-	  qentries[qfound++] = entryPtr;
+/*
+ * Execute statement for rows start..end-1 in one round trip by binding
+ * every parameter as array (column-wise binding of MariaDB).
+ */
+static int executeBulkRows(Tcl_Interp *interp,MysqlTclHandle *handle,int objc,Tcl_Obj *CONST objv[],
+			   Tcl_Obj *CONST rowObjv[],int start,int end,Tcl_WideInt *affectedPtr)
+{
+  MysqlStatement *stmt = handle->stmt;
+  MYSQL_BIND *bind;
+  MysqlStmtNum *nums;
+  Tcl_DString conv, buf;
+  Tcl_Obj **valObjv, *obj;
+  unsigned long *lengths;
+  unsigned int arraySize;
+  char **ptrs, *indicators, *str;
+  int c, r, k, n, len, valCount, utf8, offset, result = TCL_OK;
+  Tcl_WideInt execStart;
+
+  n = end-start;
+  nums = (MysqlStmtNum *)Tcl_Alloc(sizeof(MysqlStmtNum)*n*stmt->paramCount);
+  ptrs = (char **)Tcl_Alloc(sizeof(char *)*n*stmt->paramCount);
+  lengths = (unsigned long *)Tcl_Alloc(sizeof(unsigned long)*n*stmt->paramCount);
+  indicators = Tcl_Alloc(n*stmt->paramCount);
+  utf8 = isUtf8Handle(handle);
+  Tcl_DStringInit(&conv);
+
+  memset(stmt->bindParam,0,sizeof(MYSQL_BIND)*stmt->paramCount);
+  for (c = 0; c < stmt->paramCount; c++) {
+    bind = &stmt->bindParam[c];
+    bind->buffer_type = bulkColumnType(handle,rowObjv,start,end,c);
+    bind->u.indicator = indicators+c*n;
+    bind->length = lengths+c*n;
+    if (bind->buffer_type == MYSQL_TYPE_LONGLONG || bind->buffer_type == MYSQL_TYPE_DOUBLE) {
+      bind->buffer = nums+c*n;
+    } else {
+      bind->buffer = ptrs+c*n;
+    }
+    for (r = start; r < end; r++) {
+      Tcl_ListObjGetElements(NULL, rowObjv[r], &valCount, &valObjv);
+      obj = valObjv[c];
+      k = c*n+r-start;
+      ptrs[k] = NULL;
+      lengths[k] = 0;
+      if (obj->typePtr == &mysqlNullType) {
+	indicators[k] = STMT_INDICATOR_NULL;
+	continue;
+      }
+      indicators[k] = STMT_INDICATOR_NONE;
+      switch (bind->buffer_type) {
+      case MYSQL_TYPE_LONGLONG:
+	Tcl_GetWideIntFromObj(NULL, obj, &nums[k].wide);
+	break;
+      case MYSQL_TYPE_DOUBLE:
+	Tcl_GetDoubleFromObj(NULL, obj, &nums[k].dbl);
+	break;
+      case MYSQL_TYPE_BLOB:
+	ptrs[k] = (char *)Tcl_GetByteArrayFromObj(obj, &len);
+	lengths[k] = len;
+	break;
+      default:
+	str = Tcl_GetStringFromObj(obj, &len);
+	if (utf8 && isTclUtf((unsigned char *)str, len)) {
+	  ptrs[k] = str;
+	} else {
+	  /* pointer is set below, conv may still grow */
+	  Tcl_UtfToExternalDString(handle->encoding, str, len, &buf);
+	  len = Tcl_DStringLength(&buf);
+	  Tcl_DStringAppend(&conv, Tcl_DStringValue(&buf), len);
+	  Tcl_DStringFree(&buf);
+	  handle->encodedBytes += len;
 	}
-	if (qfound==16) break;
+	lengths[k] = len;
       }
-      if (qfound>0) {
-	for(i=0;i<qfound;i++) {
-	  entryPtr=qentries[i];
-	  thandle=(MysqlTclHandle *)Tcl_GetHashValue(entryPtr);
-	  Tcl_DeleteHashEntry(entryPtr);
-	  closeHandle(thandle);
+    }
+  }
+  for (offset = 0, k = 0; k < n*stmt->paramCount; k++) {
+    if (indicators[k] == STMT_INDICATOR_NONE && ptrs[k] == NULL &&
+	stmt->bindParam[k/n].buffer_type == MYSQL_TYPE_STRING) {
+      ptrs[k] = Tcl_DStringValue(&conv)+offset;
+      offset += lengths[k];
+    }
+  }
+
+  arraySize = n;
+  stmtBegin(handle,stmt->sql,(stmt->sql != NULL) ? (int)strlen(stmt->sql) : 0,0);
+  execStart = statsStart(handle);
+  if (mysql_stmt_attr_set(stmt->statement, STMT_ATTR_ARRAY_SIZE, &arraySize) ||
+      mysql_stmt_bind_param(stmt->statement, stmt->bindParam) ||
+      mysql_stmt_execute(stmt->statement)) {
+    result = mysql_stmt_confl(interp,objc,objv,stmt->statement,handle);
+  } else {
+    *affectedPtr += (Tcl_WideInt)mysql_stmt_affected_rows(stmt->statement);
+  }
+  statsServerTime(handle,execStart);
+  statsQuery(handle,0);
+  stmtEnd(handle,(result == TCL_OK) ? (Tcl_WideInt)mysql_stmt_affected_rows(stmt->statement) : -1,
+	  mysql_stmt_errno(stmt->statement));
+  arraySize = 0;
+  mysql_stmt_attr_set(stmt->statement, STMT_ATTR_ARRAY_SIZE, &arraySize);
+
+  Tcl_DStringFree(&conv);
+  Tcl_Free((char *)nums);
+  Tcl_Free((char *)ptrs);
+  Tcl_Free((char *)lengths);
+  Tcl_Free(indicators);
+  return result;
+}
+
+/*
+ * Bulk execution needs MariaDB server 10.2.6 or newer.
+ */
+static int bulkSupported(MysqlTclHandle *handle)
+{
+  return mysql_get_server_version(handle->connection) >= 100206 &&
+    strstr(mysql_get_server_info(handle->connection), "MariaDB") != NULL;
+}
+#endif
+
+/*
+ * Execute statement for every row of rowObjv (mysql::pexecute -rows).
+ * Rows are sent in bulk if server supports it, otherwise one by one.
+ * If eachObj is not NULL the affected rows of every row are appended
+ * to it (always one by one).
+ */
+static int executeRows(Tcl_Interp *interp,MysqlTclHandle *handle,int objc,Tcl_Obj *CONST objv[],
+		       int rowCount,Tcl_Obj *CONST rowObjv[],Tcl_WideInt *affectedPtr,Tcl_Obj *eachObj)
+{
+  Tcl_Obj **valObjv;
+  Tcl_WideInt affected;
+  int r, valCount;
+  char msg[60];
+#ifdef BULK_EXECUTE
+  Tcl_Obj *obj;
+  unsigned long maxLen, size, rowSize;
+  int c, len, start;
+#endif
+
+  for (r = 0; r < rowCount; r++) {
+    if (Tcl_ListObjGetElements(interp, rowObjv[r], &valCount, &valObjv) != TCL_OK)
+      return TCL_ERROR;
+    if (valCount != handle->stmt->paramCount) {
+      sprintf(msg, "row %d: statement needs %d parameters", r, handle->stmt->paramCount);
+      return mysql_prim_confl(interp,objc,objv,msg);
+    }
+  }
+#ifdef BULK_EXECUTE
+  if (eachObj == NULL && handle->stmt->paramCount > 0 && rowCount > 1 && bulkSupported(handle)) {
+    /* split rows into packets shorter than max_allowed_packet */
+    if ((maxLen = getMaxAllowedPacket(handle)) == 0)
+      return mysql_server_confl(interp,objc,objv,handle->connection,handle);
+    maxLen /= 2;
+    for (start = 0, size = 0, r = 0; r <= rowCount; r++) {
+      rowSize = 0;
+      if (r < rowCount) {
+	Tcl_ListObjGetElements(NULL, rowObjv[r], &valCount, &valObjv);
+	for (c = 0; c < valCount; c++) {
+	  obj = valObjv[c];
+	  if (obj->typePtr == &mysqlNullType) {
+	    rowSize += 1;
+	  } else if (obj->bytes == NULL && obj->typePtr != NULL &&
+		     (obj->typePtr == intType || obj->typePtr == wideIntType || obj->typePtr == doubleType)) {
+	    rowSize += 10;
+	  } else if (obj->bytes == NULL && obj->typePtr == byteArrayType) {
+	    Tcl_GetByteArrayFromObj(obj, &len);
+	    rowSize += len+10;
+	  } else {
+	    Tcl_GetStringFromObj(obj, &len);
+	    rowSize += len+10;
+	  }
 	}
       }
-      if (qfound!=16) break;
-      qfound = 0;
+      if (r > start && (r == rowCount || size+rowSize > maxLen)) {
+	if (executeBulkRows(interp,handle,objc,objv,rowObjv,start,r,affectedPtr) != TCL_OK)
+	  return TCL_ERROR;
+	start = r;
+	size = 0;
+      }
+      size += rowSize;
     }
+    return TCL_OK;
+  }
+#endif
+  for (r = 0; r < rowCount; r++) {
+    Tcl_ListObjGetElements(NULL, rowObjv[r], &valCount, &valObjv);
+    if (executeParams(interp,handle,objc,objv,valCount,valObjv) != TCL_OK)
+      return TCL_ERROR;
+    affected = (Tcl_WideInt)mysql_stmt_affected_rows(handle->stmt->statement);
+    *affectedPtr += affected;
+    if (eachObj != NULL)
+      Tcl_ListObjAppendElement(NULL, eachObj, Tcl_NewWideIntObj(affected));
   }
-  entryPtr = Tcl_FindHashEntry(&statePtr->hash,Tcl_GetStringFromObj(objv[1],NULL));
-  if (entryPtr) Tcl_DeleteHashEntry(entryPtr);
-  closeHandle(handle);
   return TCL_OK;
 }
 
-#ifdef PREPARED_STATEMENT
+/*
+ * Convert one column of fetched statement row to Tcl object.
+ */
+static Tcl_Obj *getStatementCell(MysqltclState *statePtr,MysqlTclHandle *handle,int column)
+{
+  MYSQL_BIND *bind = &handle->stmt->bindResult[column];
+  MysqlStmtValue *value = &handle->stmt->resultValues[column];
+  MYSQL_BIND longBind;
+  unsigned long length;
+  Tcl_Obj *obj;
+  char *data, buf[32];
+
+  if (value->isNull) return Mysqltcl_NewNullObj(statePtr);
+  switch (value->conversion) {
+  case CONV_WIDEINT:
+    if (bind->is_unsigned && value->num.wide < 0) {
+      /* BIGINT UNSIGNED above range of wide integer */
+      sprintf(buf, "%" TCL_LL_MODIFIER "u", (Tcl_WideUInt)value->num.wide);
+      return Tcl_NewStringObj(buf, -1);
+    }
+    return Tcl_NewWideIntObj(value->num.wide);
+  case CONV_DOUBLE:
+    return Tcl_NewDoubleObj(value->num.dbl);
+  }
+  data = (char *)bind->buffer;
+  if (value->length <= bind->buffer_length)
+    return getRowCellAsObject(statePtr,handle,&data,(int)value->length,value->conversion);
+
+  /* value is longer than buffer: fetch it again in full length */
+  length = value->length;
+  memset(&longBind,0,sizeof(MYSQL_BIND));
+  longBind.buffer_type = bind->buffer_type;
+  longBind.buffer_length = length+1;
+  longBind.buffer = data = Tcl_Alloc(length+1);
+  longBind.length = &length;
+  mysql_stmt_fetch_column(handle->stmt->statement,&longBind,column,0);
+  obj = getRowCellAsObject(statePtr,handle,&data,(int)length,value->conversion);
+  Tcl_Free(data);
+  return obj;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -2448,82 +6433,85 @@ static int Mysqltcl_Prepare(ClientData clientData, Tcl_Interp *interp, int objc,
 
   MysqlTclHandle *handle;
   MysqlTclHandle *shandle;
+  MysqlStatement *stmt;
   MYSQL_STMT *statement;
   char *query;
-  int queryLen;
-  int resultColumns;
-  int paramCount;
+  int queryLen, result;
 
   if ((handle = mysql_prologue(interp, objc, objv, 3, 3, CL_CONN,
 			    "handle sql-statement")) == 0)
     return TCL_ERROR;
-
-  statement = mysql_stmt_init(handle->connection);
-  if (statement==NULL) {
-  	return TCL_ERROR;
-  }
-  query = (char *)Tcl_GetByteArrayFromObj(objv[2], &queryLen);
-  if (mysql_stmt_prepare(statement,query,queryLen)) {
-
-  	mysql_stmt_close(statement);
-    return mysql_server_confl(interp,objc,objv,handle->connection);
-  }
-  if ((shandle = createHandleFrom(statePtr,handle,HT_STATEMENT)) == NULL) return TCL_ERROR;
-  shandle->statement=statement;
-  shandle->resultMetadata = mysql_stmt_result_metadata(statement);
-  shandle->paramMetadata = mysql_stmt_param_metadata(statement);
-  /* set result bind memory */
-  resultColumns = mysql_stmt_field_count(statement);
-  if (resultColumns>0) {
-  	shandle->bindResult = (MYSQL_BIND *)Tcl_Alloc(sizeof(MYSQL_BIND)*resultColumns);
-    memset(shandle->bindResult,0,sizeof(MYSQL_BIND)*resultColumns);
+  if (handle->type!=HT_CONNECTION)
+    return mysql_prim_confl(interp,objc,objv,"handle is not a connection");
+
+  stmt = NULL;
+  if (handle->stmtCache != NULL)
+    stmt = stmtCacheGet(handle,Tcl_GetString(objv[2]));
+  if (stmt == NULL) {
+    statement = mysql_stmt_init(handle->connection);
+    if (statement==NULL) {
+      return mysql_prim_confl(interp,objc,objv,"out of memory");
+    }
+    query = encodeTclObj(handle,objv[2],&queryLen);
+    result = mysql_stmt_prepare(statement,query,queryLen);
+    releaseQueryBuf(handle);
+    if (result) {
+      mysql_stmt_confl(interp,objc,objv,statement,handle);
+      mysql_stmt_close(statement);
+      return TCL_ERROR;
+    }
+    stmt = newStatement(handle,statement);
+    query = Tcl_GetStringFromObj(objv[2],&queryLen);
+    stmt->sql = Tcl_Alloc(queryLen+1);
+    memcpy(stmt->sql,query,queryLen+1);
+    if (handle->stmtCache != NULL) {
+      stmt->generation = handle->stmtCache->generation;
+    }
   }
-  paramCount = mysql_stmt_param_count(statement);
-  if (resultColumns>0) {
-  	shandle->bindParam = (MYSQL_BIND *)Tcl_Alloc(sizeof(MYSQL_BIND)*paramCount);
-    memset(shandle->bindParam,0,sizeof(MYSQL_BIND)*paramCount);
+  if ((shandle = createHandleFrom(statePtr,handle,HT_STATEMENT)) == NULL) {
+    freeStatement(stmt);
+    return mysql_prim_confl(interp,objc,objv,MYSQL_TOO_MANY_HANDLES);
   }
+  shandle->stmt = stmt;
+  shandle->col_count = stmt->colCount;
   Tcl_SetObjResult(interp, Tcl_NewHandleObj(statePtr,shandle));
   return TCL_OK;
 }
-static int Mysqltcl_ParamMetaData(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+
+/*----------------------------------------------------------------------
+ *
+ * Mysqltcl_PCol --
+ *    Implements the mysql::pcol command:
+ *    usage: mysql::pcol statement-handle option
+ *
+ *    results:
+ *	    column info of statement result as mysql::col
+ */
+
+static int Mysqltcl_PCol(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-  MysqltclState *statePtr = (MysqltclState *)clientData;
   MysqlTclHandle *handle;
-  MYSQL_RES *res;
-  MYSQL_ROW row;
   Tcl_Obj *colinfo,*resObj;
-  unsigned long *lengths;
-  int i;
-  int colCount;
   MYSQL_FIELD* fld;
 
   if ((handle = mysql_prologue(interp, objc, objv, 3, 3, CL_CONN,
-			    "statement-handle")) == 0)
+			    "statement-handle option")) == 0)
     return TCL_ERROR;
-  if(handle->type!=HT_STATEMENT)
-  	return TCL_ERROR;
+  if (handle->type!=HT_STATEMENT)
+    return mysql_prim_confl(interp,objc,objv,"handle is not a prepared statement");
+  if (handle->stmt->resultMetadata==NULL)
+    return TCL_OK;
 
   resObj = Tcl_GetObjResult(interp);
-  printf("statement %p count %d\n",handle->statement,mysql_stmt_param_count(handle->statement));
-  res = mysql_stmt_result_metadata(handle->statement);
-  printf("res %p\n",res);
-  if(res==NULL)
-  	return TCL_ERROR;
-
-  mysql_field_seek(res, 0) ;
-  while ((fld = mysql_fetch_field(res)) != NULL) {
-        if ((colinfo = mysql_colinfo(interp,objc,objv,fld, objv[2])) != NULL) {
-            Tcl_ListObjAppendElement(interp, resObj, colinfo);
-        } else {
-            goto conflict;
-	    }
+  mysql_field_seek(handle->stmt->resultMetadata, 0) ;
+  while ((fld = mysql_fetch_field(handle->stmt->resultMetadata)) != NULL) {
+    if ((colinfo = mysql_colinfo(interp,objc,objv,fld, objv[2])) == NULL)
+      return TCL_ERROR;
+    Tcl_ListObjAppendElement(interp, resObj, colinfo);
   }
-  conflict:
-
-  mysql_free_result(res);
   return TCL_OK;
 }
+
 /*----------------------------------------------------------------------
  *
  * Mysqltcl_PSelect --
@@ -2536,21 +6524,16 @@ static int Mysqltcl_ParamMetaData(ClientData clientData, Tcl_Interp *interp, int
 
 static int Mysqltcl_PSelect(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-  MysqltclState *statePtr = (MysqltclState *)clientData;
   MysqlTclHandle *handle;
 
-  if ((handle = mysql_prologue(interp, objc, objv, 3, 3, CL_CONN,
-			    "handle sql-statement")) == 0)
+  if ((handle = mysql_prologue(interp, objc, objv, 2, objc, CL_CONN,
+			    "statement-handle ?argument ...?")) == 0)
     return TCL_ERROR;
-  if (handle->type!=HT_STATEMENT) {
-  	return TCL_ERROR;
-  }
-  mysql_stmt_reset(handle->statement);
-  if (mysql_stmt_execute(handle->statement)) {
-  	return mysql_server_confl(interp,objc,objv,handle->connection);
-  }
-  mysql_stmt_bind_result(handle->statement, handle->bindResult);
-  mysql_stmt_store_result(handle->statement);
+  if (executeStatement(interp,handle,objc,objv) != TCL_OK)
+    return TCL_ERROR;
+  if (handle->stmt->colCount == 0)
+    return mysql_prim_confl(interp,objc,objv,"statement has no result");
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(handle->res_count));
   return TCL_OK;
 }
 /*----------------------------------------------------------------------
@@ -2560,21 +6543,42 @@ static int Mysqltcl_PSelect(ClientData clientData, Tcl_Interp *interp, int objc,
  *    usage: mysql::pfetch $statement_handle
  *
  *    results:
- *	    number of returned rows
+ *	    next row of statement result as list, empty if no row is left
  */
 
 static int Mysqltcl_PFetch(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
   MysqltclState *statePtr = (MysqltclState *)clientData;
   MysqlTclHandle *handle;
+  int i, result;
+  Tcl_WideInt start;
 
   if ((handle = mysql_prologue(interp, objc, objv, 2, 2, CL_CONN,
-			    "prep-stat-handle")) == 0)
+			    "statement-handle")) == 0)
     return TCL_ERROR;
-  if (handle->type!=HT_STATEMENT) {
-  	return TCL_ERROR;
+  if (handle->type!=HT_STATEMENT)
+    return mysql_prim_confl(interp,objc,objv,"handle is not a prepared statement");
+  if (handle->res_count == 0)
+    return TCL_OK;
+
+  result = mysql_stmt_fetch(handle->stmt->statement);
+  if (result == 1)
+    return mysql_stmt_confl(interp,objc,objv,handle->stmt->statement,handle);
+  if (result == MYSQL_NO_DATA) {
+    handle->res_count = 0;
+    return mysql_prim_confl(interp,objc,objv,"result counter out of sync");
   }
-  
+  handle->res_count--;
+
+  start = statsStart(handle);
+  if (handle->stmt->rowObjv == NULL)
+    handle->stmt->rowObjv = (Tcl_Obj **)Tcl_Alloc(sizeof(Tcl_Obj *)*handle->stmt->colCount);
+  for (i = 0; i < handle->stmt->colCount; i++) {
+    handle->stmt->rowObjv[i] = getStatementCell(statePtr,handle,i);
+  }
+  handleStats(handle)->rows++;
+  statsConvertTime(handle,start);
+  Tcl_SetObjResult(interp, Tcl_NewListObj(handle->stmt->colCount, handle->stmt->rowObjv));
   return TCL_OK;
 }
 /*----------------------------------------------------------------------
@@ -2582,37 +6586,109 @@ static int Mysqltcl_PFetch(ClientData clientData, Tcl_Interp *interp, int objc,
  * Mysqltcl_PExecute --
  *    Implements the mysql::pexecute command:
  *    usage: mysql::pexecute statement-handle ?arguments...?
+ *           mysql::pexecute statement-handle -rows rowList ?-each?
  *
  *    results:
  *	    number of effected rows
+ *	    With -rows the statement is executed for every row in one
+ *	    transaction; -each returns the affected rows of every row.
  */
 
 static int Mysqltcl_PExecute(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-  MysqltclState *statePtr = (MysqltclState *)clientData;
   MysqlTclHandle *handle;
+  Tcl_Obj **rowObjv, *eachObj = NULL;
+  Tcl_WideInt affected = 0;
+  MYSQL *connection;
+  int rowCount, result, transaction;
 
-  if ((handle = mysql_prologue(interp, objc, objv, 3, 3, CL_CONN,
-			    "handle sql-statement")) == 0)
+  if ((handle = mysql_prologue(interp, objc, objv, 2, objc, CL_CONN,
+			    "statement-handle ?argument ...?")) == 0)
     return TCL_ERROR;
-  if (handle->type!=HT_STATEMENT) {
-  	return TCL_ERROR;
-  }
-  mysql_stmt_reset(handle->statement);
+  if (objc >= 4 && objc <= 5 && strcmp(Tcl_GetString(objv[2]),"-rows") == 0) {
+    if (objc == 5 && strcmp(Tcl_GetString(objv[4]),"-each") != 0)
+      return mysql_prim_confl(interp,objc,objv,"usage: statement-handle -rows rowList ?-each?");
+    if (handle->type!=HT_STATEMENT)
+      return mysql_prim_confl(interp,objc,objv,"handle is not a prepared statement");
+    if (handle->stmt->colCount > 0)
+      return mysql_prim_confl(interp,objc,objv,"-rows is not allowed for statements with result");
+    if (Tcl_ListObjGetElements(interp, objv[3], &rowCount, &rowObjv) != TCL_OK)
+      return TCL_ERROR;
+    if (objc == 5)
+      eachObj = Tcl_NewListObj(0, NULL);
+    mysql_stmt_free_result(handle->stmt->statement);
+    handle->res_count = 0;
 
-  if (mysql_stmt_param_count(handle->statement)!=0) {
-	  Tcl_SetStringObj(Tcl_GetObjResult(interp),"works only for 0 params",-1);
-	  return TCL_ERROR;
-  }
-  if (mysql_stmt_execute(handle->statement))
-  {
-	Tcl_SetStringObj(Tcl_GetObjResult(interp),mysql_stmt_error(handle->statement),-1);
-  	return TCL_ERROR;
+    /* the rows are executed in one transaction if there is none */
+    connection = handle->connection;
+    transaction = rowCount > 1 && (connection->server_status & SERVER_STATUS_AUTOCOMMIT) &&
+      !(connection->server_status & SERVER_STATUS_IN_TRANS);
+    if (transaction && mysql_autocommit(connection, 0)) {
+      if (eachObj != NULL) Tcl_DecrRefCount(eachObj);
+      return mysql_server_confl(interp,objc,objv,connection,handle);
+    }
+    /* the row list must not change while it is executed */
+    Tcl_IncrRefCount(objv[3]);
+    result = executeRows(interp,handle,objc,objv,rowCount,rowObjv,&affected,eachObj);
+    Tcl_DecrRefCount(objv[3]);
+    if (transaction) {
+      if (result == TCL_OK) {
+	if (mysql_commit(connection))
+	  result = mysql_server_confl(interp,objc,objv,connection,handle);
+      }
+      if (result != TCL_OK)
+	mysql_rollback(connection);
+      mysql_autocommit(connection, 1);
+    }
+    if (result != TCL_OK) {
+      if (eachObj != NULL) Tcl_DecrRefCount(eachObj);
+      return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, (eachObj != NULL) ? eachObj : Tcl_NewWideIntObj(affected));
+    return TCL_OK;
   }
+  if (executeStatement(interp,handle,objc,objv) != TCL_OK)
+    return TCL_ERROR;
+  Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)mysql_stmt_affected_rows(handle->stmt->statement)));
   return TCL_OK;
 }
 #endif
 
+/*
+ * Called by exit of thread that has loaded mysqltcl
+ */
+static void Mysqltcl_ThreadExit(ClientData clientData)
+{
+  mysql_thread_end();
+}
+
+/*
+ * Initialize client library once per process and per thread.
+ * Connections of shared pools can be used by every thread after this.
+ */
+static void Mysqltcl_InitLibrary(void)
+{
+  ThreadSpecificData *tsdPtr;
+
+  Tcl_MutexLock(&mysqltclMutex);
+  if (!mysqltclInitialized) {
+#if (MYSQL_VERSION_ID >= 50003)
+    mysql_library_init(0, NULL, NULL);
+#else
+    mysql_server_init(0, NULL, NULL);
+#endif
+    Tcl_InitHashTable(&sharedPools, TCL_STRING_KEYS);
+    mysqltclInitialized = 1;
+  }
+  Tcl_MutexUnlock(&mysqltclMutex);
+  tsdPtr = (ThreadSpecificData *)Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+  if (!tsdPtr->threadInitialized) {
+    mysql_thread_init();
+    Tcl_CreateThreadExitHandler(Mysqltcl_ThreadExit, NULL);
+    tsdPtr->threadInitialized = 1;
+  }
+}
+
 /*
  *----------------------------------------------------------------------
  * Mysqltcl_Init
@@ -2633,11 +6709,12 @@ int Mysqltcl_Init(interp)
     Tcl_Interp *interp;
 {
   char nbuf[MYSQL_SMALL_SIZE];
+  CONST char *statusMode;
   MysqltclState *statePtr;
  
-  if (Tcl_InitStubs(interp, "8.1", 0) == NULL)
+  if (Tcl_InitStubs(interp, "8.5", 0) == NULL)
     return TCL_ERROR;
-  if (Tcl_PkgRequire(interp, "Tcl", "8.1", 0) == NULL)
+  if (Tcl_PkgRequire(interp, "Tcl", "8.5", 0) == NULL)
     return TCL_ERROR;
   if (Tcl_PkgProvide(interp, "mysqltcl" , PACKAGE_VERSION) != TCL_OK)
     return TCL_ERROR;
@@ -2646,9 +6723,25 @@ int Mysqltcl_Init(interp)
    * Initialize the new Tcl commands.
    * Deleting any command will close all connections.
    */
+   Mysqltcl_InitLibrary();
    statePtr = (MysqltclState*)Tcl_Alloc(sizeof(MysqltclState)); 
-   Tcl_InitHashTable(&statePtr->hash, TCL_STRING_KEYS);
-   statePtr->handleNum = 0;
+   statePtr->slots = NULL;
+   statePtr->slotCount = 0;
+   statePtr->slotsUsed = 0;
+   statePtr->freeSlot = -1;
+   Tcl_InitHashTable(&statePtr->pools, TCL_STRING_KEYS);
+   Tcl_SetAssocData(interp, MYSQL_ASSOC_KEY, NULL, (ClientData)statePtr);
+   statePtr->statusLazy = 0;
+   statePtr->statusCode = 0;
+   statePtr->statsTiming = 0;
+   memset(&statePtr->closedStats,0,sizeof(MysqlStats));
+   statePtr->trace = NULL;
+   statePtr->traceCount = 0;
+   statePtr->traceAsync = NULL;
+   statePtr->histogramOn = 0;
+   Tcl_InitHashTable(&statePtr->histograms, TCL_STRING_KEYS);
+   statePtr->histGeneration = 0;
+   statePtr->interp = interp;
 
    Tcl_CreateObjCommand(interp,"mysqlconnect",Mysqltcl_Connect,(ClientData)statePtr, NULL);
    Tcl_CreateObjCommand(interp,"mysqluse", Mysqltcl_Use,(ClientData)statePtr, NULL);
@@ -2679,6 +6772,11 @@ int Mysqltcl_Init(interp)
    Tcl_CreateObjCommand(interp,"::mysql::seek", Mysqltcl_Seek,(ClientData)statePtr, NULL);
    Tcl_CreateObjCommand(interp,"::mysql::map", Mysqltcl_Map,(ClientData)statePtr, NULL);
    Tcl_CreateObjCommand(interp,"::mysql::exec", Mysqltcl_Exec,(ClientData)statePtr, NULL);
+   Tcl_CreateObjCommand(interp,"::mysql::insert", Mysqltcl_Insert,(ClientData)statePtr, NULL);
+   Tcl_CreateObjCommand(interp,"::mysql::batch", Mysqltcl_Batch,(ClientData)statePtr, NULL);
+#if (MYSQL_VERSION_ID >= 40102)
+   Tcl_CreateObjCommand(interp,"::mysql::load", Mysqltcl_Load,(ClientData)statePtr, NULL);
+#endif
    Tcl_CreateObjCommand(interp,"::mysql::close", Mysqltcl_Close,(ClientData)statePtr, NULL);
    Tcl_CreateObjCommand(interp,"::mysql::info", Mysqltcl_Info,(ClientData)statePtr, NULL);
    Tcl_CreateObjCommand(interp,"::mysql::result", Mysqltcl_Result,(ClientData)statePtr, NULL);
@@ -2704,13 +6802,18 @@ int Mysqltcl_Init(interp)
    Tcl_CreateObjCommand(interp,"::mysql::setserveroption", Mysqltcl_SetServerOption,(ClientData)statePtr, NULL);
    Tcl_CreateObjCommand(interp,"::mysql::shutdown", Mysqltcl_ShutDown,(ClientData)statePtr, NULL);
    Tcl_CreateObjCommand(interp,"::mysql::encoding", Mysqltcl_Encoding,(ClientData)statePtr, NULL);
+   Tcl_CreateObjCommand(interp,"::mysql::config", Mysqltcl_Config,(ClientData)statePtr, NULL);
+   Tcl_CreateObjCommand(interp,"::mysql::stats", Mysqltcl_Stats,(ClientData)statePtr, NULL);
+   Tcl_CreateObjCommand(interp,"::mysql::trace", Mysqltcl_Trace,(ClientData)statePtr, NULL);
+   Tcl_CreateObjCommand(interp,"::mysql::histogram", Mysqltcl_Histogram,(ClientData)statePtr, NULL);
+   Tcl_CreateObjCommand(interp,"::mysql::pool", Mysqltcl_Pool,(ClientData)statePtr, NULL);
    /* prepared statements */
 
 #ifdef PREPARED_STATEMENT
    Tcl_CreateObjCommand(interp,"::mysql::prepare", Mysqltcl_Prepare,(ClientData)statePtr, NULL);
-   // Tcl_CreateObjCommand(interp,"::mysql::parammetadata", Mysqltcl_ParamMetaData,(ClientData)statePtr, NULL);
+   Tcl_CreateObjCommand(interp,"::mysql::pcol", Mysqltcl_PCol,(ClientData)statePtr, NULL);
    Tcl_CreateObjCommand(interp,"::mysql::pselect", Mysqltcl_PSelect,(ClientData)statePtr, NULL);
-   Tcl_CreateObjCommand(interp,"::mysql::pselect", Mysqltcl_PFetch,(ClientData)statePtr, NULL);
+   Tcl_CreateObjCommand(interp,"::mysql::pfetch", Mysqltcl_PFetch,(ClientData)statePtr, NULL);
    Tcl_CreateObjCommand(interp,"::mysql::pexecute", Mysqltcl_PExecute,(ClientData)statePtr, NULL);
 #endif
    
@@ -2725,12 +6828,17 @@ int Mysqltcl_Init(interp)
    strcpy (statePtr->MysqlNullvalue, MYSQL_NULLV_INIT);
    sprintf (nbuf, "%s(%s)", MYSQL_STATUS_ARR, MYSQL_STATUS_NULLV);
 
-   /* set null object in mysqltcl state */
-   /* statePtr->nullObjPtr = Mysqltcl_NewNullObj(statePtr); */
-   
    if (Tcl_LinkVar(interp,nbuf,(char *)&statePtr->MysqlNullvalue, TCL_LINK_STRING) != TCL_OK)
      return TCL_ERROR;
+   /* status mode for all interpreters of process (see mysql::config -status) */
+   statusMode = Tcl_GetVar2(interp, "env", "MYSQLTCL_STATUS", TCL_GLOBAL_ONLY);
+   if (statusMode != NULL && strcmp(statusMode, "lazy") == 0)
+     setStatusMode(statePtr, 1);
    
+   byteArrayType = Tcl_GetObjType("bytearray");
+   intType = Tcl_GetObjType("int");
+   wideIntType = Tcl_GetObjType("wideInt");
+   doubleType = Tcl_GetObjType("double");
    /* Register the handle object type */
    Tcl_RegisterObjType(&mysqlHandleType);
    /* Register own null type object */
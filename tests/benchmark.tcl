@@ -0,0 +1,118 @@
+#!/usr/bin/tcl
+# Micro benchmark for reading rows
+# usage: tclsh benchmark.tcl ?rows? ?encoding? ?baseline-file?
+# Time per row is measured for every fetch path.
+# Allocations per row are shown only if tclsh is build with TCL_MEM_DEBUG
+# (command "memory info" is available)
+# The connect variables are the same as in test.test, please adapt them.
+#
+# Comparison with a baseline:
+# run the benchmark with the old library and a not existing baseline-file,
+# the results are saved into it. Then build the new library and run it
+# again with the same baseline-file, rows and encoding; every line shows
+# the baseline time and the ratio new/old.
+
+if {[file exists libload.tcl]} {
+    source libload.tcl
+} else {
+    source [file join [file dirname [info script]] libload.tcl]
+}
+
+set rows 20000
+set encoding utf-8
+if {[llength $argv]>0} {set rows [lindex $argv 0]}
+if {[llength $argv]>1} {set encoding [lindex $argv 1]}
+set baseline ""
+if {[llength $argv]>2} {set baseline [lindex $argv 2]}
+
+# global connect variables
+set dbuser root
+set dbpassword ""
+set dbank mysqltcltest
+
+array set base {}
+if {$baseline ne "" && [file exists $baseline]} {
+    set f [open $baseline]
+    array set base [read $f]
+    close $f
+}
+array set results {}
+
+set options [list -user $dbuser -db $dbank -encoding $encoding]
+if {$dbpassword ne ""} {
+    lappend options -password $dbpassword
+}
+set c [eval mysqlconnect $options]
+mysql::exec $c {DROP TABLE IF EXISTS Bench}
+mysql::exec $c {CREATE TABLE Bench (id INT NOT NULL, name VARCHAR(40), note VARCHAR(40), amount DOUBLE)}
+set values [list]
+for {set i 0} {$i<$rows} {incr i} {
+    lappend values "($i,'name $i','näme',NULL)"
+    if {[llength $values]>=1000} {
+	mysql::exec $c "INSERT INTO Bench VALUES [join $values ,]"
+	set values [list]
+    }
+}
+if {[llength $values]>0} {
+    mysql::exec $c "INSERT INTO Bench VALUES [join $values ,]"
+}
+
+proc mallocs {} {
+    if {[catch {memory info} info]} {
+	return {}
+    }
+    foreach line [split $info \n] {
+	if {[string match "total mallocs*" $line]} {
+	    return [lindex $line end]
+	}
+    }
+    return {}
+}
+
+proc bench {name script} {
+    global rows base results
+    set m [mallocs]
+    set t [lindex [time {uplevel #0 $script} 1] 0]
+    set perRow [expr {double($t)/$rows}]
+    set results($name) $perRow
+    set line [format "%-22s %8.3f us/row" $name $perRow]
+    if {$m ne ""} {
+	append line [format " %8.2f allocs/row" [expr {double([mallocs]-$m)/$rows}]]
+    }
+    if {[info exists base($name)] && $base($name) > 0} {
+	append line [format "  baseline %8.3f us/row  ratio %5.2f" $base($name) [expr {$perRow/$base($name)}]]
+    }
+    puts $line
+}
+
+set sql {SELECT id,name,note,amount FROM Bench}
+bench "sel -list" {mysql::sel $c $sql -list}
+bench "sel -flatlist" {mysql::sel $c $sql -flatlist}
+bench "sel -columns" {mysql::sel $c $sql -columns}
+bench "sel -dicts" {mysql::sel $c $sql -dicts}
+bench "sel -list -typed" {mysql::sel $c $sql -list -typed}
+bench "fetch" {
+    mysql::sel $c $sql
+    while {[llength [mysql::fetch $c]]} {}
+}
+bench "fetch -count 100" {
+    mysql::sel $c $sql
+    while {[llength [mysql::fetch $c -count 100]]} {}
+}
+bench "map" {
+    mysql::sel $c $sql
+    mysql::map $c {id name note amount} {}
+}
+bench "receive" {
+    mysql::receive $c $sql {id name note amount} {}
+}
+
+mysql::exec $c {DROP TABLE Bench}
+mysql::close $c
+
+if {$baseline ne "" && ![file exists $baseline]} {
+    set f [open $baseline w]
+    puts $f [array get results]
+    close $f
+    puts "baseline saved to $baseline"
+}